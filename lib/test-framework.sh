@@ -17,6 +17,7 @@ CURRENT_PHASE=""
 # VM paths
 VM_BINARY="./vm"
 COMPILER_BINARY="./compiler"
+VM_FLAGS="" # extra options for run_vm, e.g. VM_FLAGS="-O0 --tier=reg" run_vm prog.vm
 
 # Test output
 TEST_OUTPUT=""
@@ -49,8 +50,8 @@ run_vm() {
         return 1
     fi
     
-    TEST_OUTPUT=$(timeout "$timeout" "$VM_BINARY" "$bytecode_file" 2>&1)
-    TEST_EXIT_CODE=$?
+    TEST_EXIT_CODE=0
+    TEST_OUTPUT=$(timeout "$timeout" "$VM_BINARY" $VM_FLAGS "$bytecode_file" 2>&1) || TEST_EXIT_CODE=$?
     
     if [ $TEST_EXIT_CODE -eq 124 ]; then
         echo -e "${RED}✗${NC} VM timed out after ${timeout}s"
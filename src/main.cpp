@@ -1,12 +1,39 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <stack>
 #include <cassert>
 #include <unordered_map>
+#include <unordered_set>
 #include <cctype>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <csignal>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <cerrno>
+#include <dirent.h>
+#include <sys/file.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 enum class Opcode {
@@ -41,24 +68,61 @@ enum class Opcode {
     PRINT,
     JUMP_IF_FALSE,
     JUMP,
+    JUMP_IF_TRUE, // produced by the optimizer from "NOT; JUMP_IF_FALSE"
+    PUSH_TRUE,
+    PUSH_FALSE,
+
+    // superinstructions, only produced by fuseSuperinstructions()
+    ADD_LL, // push local a + local b
+    ADD_K, // top += constant
+    SET_LOCAL_POP,
+    JUMP_IF_NOT_LT, // pop b, pop a, jump unless a < b
+    JUMP_IF_NOT_LE,
+    JUMP_IF_NOT_GT,
+    JUMP_IF_NOT_GE,
+    JUMP_IF_NOT_EQ,
+    JUMP_IF_NOT_NE,
+    FOR_RANGE, // slot, constant limit, body: local += 1, jump to body while local < limit
+    FOR_RANGE_L, // slot, limit slot, body
+
+    // packed arrays (see the kernels next to ObjHeader)
+    ALLOC_PACKED, // length, HeapType of the array
+    ARRAY_FILL,   // pop value, pop array: every element = value
+    ARRAY_COPY,   // pop source, pop destination (same kind, at least as long): copy source to its front
+    ARRAY_SUM,    // array -> sum of its elements
+    ARRAY_MIN,    // array -> smallest element, nil if empty
+    ARRAY_MAX,
+    ARRAY_EQUAL,  // a, b -> same kind, length and elements
+    ARRAY_MAP,    // op (ADD, SUB or MUL); pop constant, pop array: every element = element op constant
+
+    // maps (see MapData)
+    ALLOC_MAP, // expected entries
+    MAP_GET,   // map, key -> value, nil if absent
+    MAP_SET,   // pop value, pop key, pop map
+    MAP_DEL,   // pop key, pop map
 
     HALT
 };
+constexpr int OPCODE_COUNT = (int)Opcode::HALT + 1;
 
 enum class ValueType {
+    NIL, // first, so a nil Value is all zero bits (see Heap::allocateMapped)
     INT,
-    NIL,
     BOOL,
     OBJECT
 };
 
-enum class HeapType {
+enum class HeapType : uint8_t {
     STRING,
-    ARRAY
+    ARRAY,
+    // packed arrays: raw elements instead of Values, so they never hold a handle and the collector never scans them
+    INT32_ARRAY,
+    INT64_ARRAY,
+    BOOL_ARRAY,
+    MAP
 };
-int allocatedSinceLastGC = 0;
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     LEFT_PAREN, // (
     RIGHT_PAREN, // )
     LEFT_BRACE, // {
@@ -87,9 +151,6 @@ enum class TokenType {
     INTEGER,
     STRING,
 
-    TAB,
-    CARR_RETURN,
-
     LET,
     FUN,
     IF,
@@ -97,58 +158,73 @@ enum class TokenType {
     RETURN,
     WHILE,
     NIL,
+    TRUE,
+    FALSE,
     PRINT,
     ENDOF
 };
 
 struct Token {
-    TokenType type;
-    string lexeme;
+    string_view lexeme; // points into the source buffer
     int line;
+    TokenType type;
 };
-class Compiler;
-struct Expr {
-    virtual ~Expr() = default; // to enable polymorphism and consistent treatment of all expressions.
-    virtual void compile(Compiler &c){};
-};
-
-struct Stmt {
-    virtual ~Stmt() = default;
-    virtual void compile(Compiler& c){};
-};
+// Two interchangeable Value layouts behind the same accessors:
+//  - default: a tag enum plus a union payload (32-bit ints).
+//  - -DVM_TAGGED_VALUES: tag and payload packed into one 64-bit word. Integers are stored shifted left with the
+//    low bit set (63-bit range); everything else keeps its tag in the low 3 bits: 000 nil, 010 bool (payload in
+//    bit 3), 100 object (heap handle in the upper bits). Type checks are a single mask test.
+#ifdef VM_TAGGED_VALUES
+typedef int64_t vmint;
 
-class Compiler {
-    public:
-    vector<int> bytecode;
-    int nextLocalSlot = 0;
-    
-    Opcode opcodeFor(TokenType t) {
-        switch (t) {
-            case TokenType::PLUS: return Opcode::ADD;
-            case TokenType::MINUS: return Opcode::SUB;
-            case TokenType::MULTIPLY: return Opcode::MUL;
-            case TokenType::DIVIDE: return Opcode::DIV;
+struct Value {
+    uint64_t bits;
 
-            case TokenType::EQUAL_EQUAL: return Opcode::EQUAL;
-            case TokenType::NOTEQUAL: return Opcode::NOTEQUAL;
-            case TokenType::LESS_THAN: return Opcode::LESSTHAN;
-            case TokenType::LESSEQUAL: return Opcode::LESSEQUAL;
-            case TokenType::GRTR_THAN: return Opcode::GRTRTHAN;
-            case TokenType::GRTREQL: return Opcode::GRTREQUAL;
+    static constexpr uint64_t TAG_MASK = 7, TAG_NIL = 0, TAG_BOOL = 2, TAG_OBJECT = 4;
 
-            default: assert(false);
-        }
+    static Value Int(vmint x){
+        Value v;
+        v.bits = ((uint64_t)x << 1) | 1;
+        return v;
+    }
+    static Value Bool(bool x){
+        Value v;
+        v.bits = ((uint64_t)x << 3) | TAG_BOOL;
+        return v;
+    }
+    static Value Nil(){
+        return Value();
+    }
+    static Value Object(int handle){
+        Value v;
+        v.bits = ((uint64_t)(uint32_t)handle << 3) | TAG_OBJECT;
+        return v;
     }
-    unordered_map<string, int> varSlots;
+    Value() : bits(TAG_NIL) {}
+
+    bool isInt() const { return bits & 1; }
+    bool isBool() const { return (bits & TAG_MASK) == TAG_BOOL; }
+    bool isNil() const { return bits == TAG_NIL; }
+    bool isObject() const { return (bits & TAG_MASK) == TAG_OBJECT; }
+    bool isNumber() const { return isInt() || isBool(); } // bool is implicitly convertible to int
 
-    vector<int> compileProgram(vector<Stmt*> stmts){
-        for (auto stmt : stmts){
-            stmt->compile(*this);
+    vmint asInt() const { return (int64_t)bits >> 1; }
+    bool asBool() const { return bits >> 3; }
+    int asHandle() const { return (int)(bits >> 3); }
+    vmint asNumber() const { return isInt() ? asInt() : (vmint)asBool(); }
+
+    ValueType type() const {
+        if (isInt()) return ValueType::INT;
+        switch (bits & TAG_MASK){
+            case TAG_BOOL: return ValueType::BOOL;
+            case TAG_OBJECT: return ValueType::OBJECT;
+            default: return ValueType::NIL;
         }
-        bytecode.push_back((int)Opcode::HALT);
-        return bytecode;
     }
 };
+#else
+typedef int vmint;
+
 struct Value { //tagged union
     ValueType tag;
     union {
@@ -186,1175 +262,4228 @@ struct Value { //tagged union
         v.data.objectHandle = handle;
         return v;
     }
-    Value(){ tag = ValueType::NIL; } // to prevent accidental default construction.
-};
+    Value(){ tag = ValueType::NIL; data.intVal = 0; } // to prevent accidental default construction.
 
-struct LiteralExpr : Expr {
-    Value value;
+    bool isInt() const { return tag == ValueType::INT; }
+    bool isBool() const { return tag == ValueType::BOOL; }
+    bool isNil() const { return tag == ValueType::NIL; }
+    bool isObject() const { return tag == ValueType::OBJECT; }
+    bool isNumber() const { return tag == ValueType::INT || tag == ValueType::BOOL; } // bool is implicitly convertible to int
 
-    void compile (Compiler &c){
-        c.bytecode.push_back((int)Opcode::PUSH);
-        c.bytecode.push_back(value.data.intVal);
-    }
+    vmint asInt() const { return data.intVal; }
+    bool asBool() const { return data.boolVal; }
+    int asHandle() const { return data.objectHandle; }
+    vmint asNumber() const { return tag == ValueType::BOOL ? (int)data.boolVal : data.intVal; }
 
-    LiteralExpr(Value v) : value(v) {}
+    ValueType type() const { return tag; }
 };
-struct BinaryExpr : Expr {
-    Expr* left;
-    TokenType op;
-    Expr* right;
+#endif
+static_assert(sizeof(Value) == 8, "Value should stay one machine word");
 
-    void compile(Compiler& c) {
-        left->compile(c);
-        right->compile(c);
-        c.bytecode.push_back((int)c.opcodeFor(op));
-    }
+// == semantics: ints and bools compare numerically, objects by handle, nil only equals nil. Strings are interned
+// (see Heap::makePermanent), so for them the handle compare is a content compare.
+bool valuesEqual(const Value& a, const Value& b){
+    if (a.isNumber() && b.isNumber()) return a.asNumber() == b.asNumber();
+    if (a.isObject() && b.isObject()) return a.asHandle() == b.asHandle();
+    return a.isNil() && b.isNil();
+}
 
-    BinaryExpr(Expr* l, TokenType o, Expr* r) : left(l), right(r), op(o) {}
+// Syntax tree. All nodes of a top-level statement live in one flat array owned by an Ast and refer to each other by
+// index, so a tree is a handful of allocations and is dropped in one go with clear() once the statement has been
+// compiled. Block bodies are runs of node ids in `lists`, identifiers are interned into `names` and string literals
+// into `strings`; both outlive clear(), because later statements refer to the same variables and constants.
+enum class NodeKind : uint8_t {
+    LITERAL,    // value
+    IDENTIFIER, // a = name
+    BINARY,     // op, a = left, b = right
+    UNARY,      // op, a = operand
+    ASSIGN,     // a = name, b = value; an expression, the value stays on the stack
+    EXPR_STMT,  // a = expression
+    VAR_DECL,   // a = name, b = initializer, -1 to only reserve the name's slot (see Folder::dropped)
+    PRINT,      // a = expression
+    BLOCK,      // a = first entry in lists, b = count
+    IF,         // a = condition, b = body
+    WHILE,      // a = condition, b = body
+    STRING,     // a = index into strings
+    ERROR,
 };
-struct UnaryExpr : Expr {
+typedef int32_t NodeId;
+
+struct Node {
+    NodeKind kind;
     TokenType op;
-    Expr* exp;
+    int32_t line; // source line, statements only
+    int32_t a, b;
+    Value value;
+};
+static_assert(sizeof(Node) == 24, "keep AST nodes compact");
 
-    void compile(Compiler &c){
-        exp->compile(c);
-        if (op == TokenType::MINUS) c.bytecode.push_back((int)Opcode::NEG);
-        else if (op == TokenType::NOT) c.bytecode.push_back((int)Opcode::NOT);
-    }
+struct Ast {
+    vector<Node> nodes;
+    vector<NodeId> lists;
+    vector<string> names;
+    unordered_map<string, int> nameIds;
+    vector<string> strings; // string literals, the program's constant pool
+    unordered_map<string, int> stringIds;
 
-    UnaryExpr(TokenType o, Expr* e) : op(o), exp(e) {}
+    NodeId add(NodeKind kind, int32_t a = -1, int32_t b = -1, TokenType op = TokenType::ENDOF){
+        nodes.push_back({kind, op, 0, a, b, Value()});
+        return nodes.size() - 1;
+    }
+    NodeId literal(Value v){
+        NodeId id = add(NodeKind::LITERAL);
+        nodes[id].value = v;
+        return id;
+    }
+    int name(string_view s){
+        string key(s);
+        auto it = nameIds.find(key);
+        if (it != nameIds.end()) return it->second;
+        names.push_back(key);
+        return nameIds[key] = names.size() - 1;
+    }
+    int stringConstant(string_view s){
+        string key(s);
+        auto it = stringIds.find(key);
+        if (it != stringIds.end()) return it->second;
+        strings.push_back(key);
+        return stringIds[key] = strings.size() - 1;
+    }
+    void clear(){
+        nodes.clear();
+        lists.clear();
+    }
+    Node& operator[](NodeId id){ return nodes[id]; }
+    const Node& operator[](NodeId id) const { return nodes[id]; }
 };
-struct GroupingExpr : Expr {
-    Expr* exp;
 
-    void compile(Compiler &c){
-        exp->compile(c);
+// Folds literal arithmetic the way the interpreter would compute it. Gives up on anything that would fail at
+// runtime (division by zero, type errors) or does not fit the int operand of PUSH, so the error stays at runtime.
+bool foldBinary(TokenType op, const Value& a, const Value& b, Value& out){
+    if (op == TokenType::EQUAL_EQUAL) { out = Value::Bool(valuesEqual(a, b)); return true; }
+    if (op == TokenType::NOTEQUAL) { out = Value::Bool(!valuesEqual(a, b)); return true; }
+    if (!a.isNumber() || !b.isNumber()) return false;
+    int64_t x = a.asNumber(), y = b.asNumber(), r;
+    switch (op){
+        case TokenType::PLUS: r = x + y; break;
+        case TokenType::MINUS: r = x - y; break;
+        case TokenType::MULTIPLY: r = x * y; break; // both fit in 32 bits, no overflow in 64
+        case TokenType::DIVIDE: if (y == 0) return false; r = x / y; break;
+        case TokenType::MOD: if (y == 0) return false; r = x % y; break;
+        case TokenType::LESS_THAN: out = Value::Bool(x < y); return true;
+        case TokenType::LESSEQUAL: out = Value::Bool(x <= y); return true;
+        case TokenType::GRTR_THAN: out = Value::Bool(x > y); return true;
+        case TokenType::GRTREQL: out = Value::Bool(x >= y); return true;
+        default: return false;
     }
+    if (r < INT32_MIN || r > INT32_MAX) return false;
+    out = Value::Int((int)r);
+    return true;
+}
 
-    GroupingExpr(Expr* e) : exp(e) {}
-};
-struct IdentifierExpr : Expr {
-    string name;
+bool isArithmetic(TokenType op){
+    return op == TokenType::PLUS || op == TokenType::MINUS || op == TokenType::MULTIPLY
+        || op == TokenType::DIVIDE || op == TokenType::MOD;
+}
+
+// Constant folding (-O1 and up), walking the tree in execution order. intVars holds the variables known to be ints
+// at the current point: set by a top-level `let` with an int initializer, cleared by any assignment that may not be
+// an int, and by every assignment inside a loop before the loop is folded. Declarations inside a branch or loop never
+// count, the branch may not run. A body dropped for a false condition keeps its names (see dropped): a name declared
+// in dead code still gets its slot at -O0 and reads nil there, and an undefined one is still an error.
+struct Folder {
+    Ast& ast;
+    vector<char> intVars; // by name id
+    int depth = 0;        // nesting of if/while bodies
+    int folded = 0;
+
+    Folder(Ast& a) : ast(a) {}
 
-    IdentifierExpr(string n) : name(n) {}
-    void compile(Compiler& c){
-        int n = c.varSlots[name];
-        c.bytecode.push_back((int)Opcode::GET_LOCAL);
-        c.bytecode.push_back(n);
+    bool isInt(int name){ return name < (int)intVars.size() && intVars[name]; }
+    void setInt(int name, bool v){
+        if (name >= (int)intVars.size()) intVars.resize(name + 1, false);
+        intVars[name] = v;
+    }
+    bool isLiteralInt(NodeId e, vmint n){
+        return ast[e].kind == NodeKind::LITERAL && ast[e].value.isInt() && ast[e].value.asInt() == n;
+    }
+    bool isLiteralBool(NodeId e, bool b){
+        return ast[e].kind == NodeKind::LITERAL && ast[e].value.isBool() && ast[e].value.asBool() == b;
     }
-};
-struct ErrorExpr : Expr {
-    int line;
-    ErrorExpr(int l) : line(l) {}
-};
 
-struct ExprStmt : Stmt { // compile an expression
-    Expr* expr;
-    ExprStmt(Expr* e) : expr(e) {}
-    void compile(Compiler& c){
-        expr->compile(c);
-        c.bytecode.push_back((int)Opcode::POP);
+    // always evaluates to an int (or fails at runtime)
+    bool staticInt(NodeId e){
+        const Node& n = ast[e];
+        switch (n.kind){
+            case NodeKind::LITERAL: return n.value.isInt();
+            case NodeKind::IDENTIFIER: return isInt(n.a);
+            case NodeKind::BINARY: return isArithmetic(n.op);
+            case NodeKind::UNARY: return n.op == TokenType::MINUS;
+            case NodeKind::ASSIGN: return staticInt(n.b);
+            default: return false;
+        }
     }
-};
-struct VarDeclStmt : Stmt { // introduce a name and store a local value on the callstack
-    string name;
-    Expr* initializerExpr;
-    VarDeclStmt(string n, Expr* e) : name(n), initializerExpr(e) {}
-
-    void compile(Compiler& c){
-        initializerExpr->compile(c); // push compiled value onto the stack
-        c.varSlots[name] = c.nextLocalSlot;
-        c.bytecode.push_back((int)Opcode::SET_LOCAL); // push setlocal back into bytecode
-        c.bytecode.push_back(c.nextLocalSlot);
-        c.nextLocalSlot++;
-        c.bytecode.push_back((int)Opcode::POP); // pop compiled value from stack
+    // no side effects and cannot fail at runtime
+    bool pure(NodeId e){
+        const Node& n = ast[e];
+        switch (n.kind){
+            case NodeKind::LITERAL: case NodeKind::IDENTIFIER: case NodeKind::STRING: return true;
+            case NodeKind::UNARY: return n.op == TokenType::MINUS && pure(n.a) && staticInt(n.a);
+            case NodeKind::BINARY:
+                // comparisons never fail; arithmetic does on non-numbers or a zero divisor
+                if (!pure(n.a) || !pure(n.b)) return false;
+                return !isArithmetic(n.op) || (n.op != TokenType::DIVIDE && n.op != TokenType::MOD && staticInt(n.a) && staticInt(n.b));
+            default: return false;
+        }
     }
-};
-struct AssignmentStmt : Stmt { // modify an existing variable (variable must exist on the top of the callstack)
-    string name;
-    Expr* valueExpr;
-    AssignmentStmt(string n, Expr* e) : name(n), valueExpr(e) {}
-    void compile(Compiler& c){
-        valueExpr->compile(c); //compile value
-        c.bytecode.push_back((int)Opcode::SET_LOCAL); // emit set local
-        c.bytecode.push_back(c.varSlots[name]); // emit index of variable in the locals vector
-        c.bytecode.push_back((int)Opcode::POP);
+    // variables written anywhere inside
+    void assigns(NodeId id, vector<int>& names){
+        const Node& n = ast[id];
+        switch (n.kind){
+            case NodeKind::ASSIGN: case NodeKind::VAR_DECL: names.push_back(n.a); if (n.b >= 0) assigns(n.b, names); break;
+            case NodeKind::BINARY: case NodeKind::IF: case NodeKind::WHILE: assigns(n.a, names); assigns(n.b, names); break;
+            case NodeKind::UNARY: case NodeKind::EXPR_STMT: case NodeKind::PRINT: assigns(n.a, names); break;
+            case NodeKind::BLOCK:
+                for (int i = 0; i < n.b; i++) assigns(ast.lists[n.a + i], names);
+                break;
+            default: break;
+        }
     }
-};
-struct ErrorStmt : Stmt {
-    int line;
-    ErrorStmt(int l) : line(l) {
-        assert(0 > 1);
+
+    // returns the simplified expression, possibly a new node
+    NodeId expr(NodeId e){
+        switch (ast[e].kind){
+            case NodeKind::BINARY: return binary(e);
+            case NodeKind::UNARY: {
+                NodeId x = expr(ast[e].a);
+                ast[e].a = x;
+                if (ast[x].kind != NodeKind::LITERAL) return e;
+                Value v = ast[x].value;
+                if (ast[e].op == TokenType::MINUS && v.isInt() && v.asInt() != INT32_MIN){
+                    folded++;
+                    return ast.literal(Value::Int(-(int)v.asInt()));
+                }
+                if (ast[e].op == TokenType::NOT && v.isBool()){
+                    folded++;
+                    return ast.literal(Value::Bool(!v.asBool()));
+                }
+                return e;
+            }
+            case NodeKind::ASSIGN: {
+                NodeId v = expr(ast[e].b);
+                ast[e].b = v;
+                if (!staticInt(v)) setInt(ast[e].a, false);
+                return e;
+            }
+            default: return e;
+        }
+    }
+    NodeId binary(NodeId e){
+        NodeId l = expr(ast[e].a); // operands in evaluation order, so assignments inside are seen in the right place
+        NodeId r = expr(ast[e].b);
+        ast[e].a = l;
+        ast[e].b = r;
+        TokenType op = ast[e].op;
+        if (ast[l].kind == NodeKind::LITERAL && ast[r].kind == NodeKind::LITERAL){
+            Value v;
+            if (!foldBinary(op, ast[l].value, ast[r].value, v)) return e;
+            folded++;
+            return ast.literal(v);
+        }
+        // identities; the remaining operand must already be an int, as the arithmetic would turn a bool into one
+        NodeId kept = -1;
+        if ((op == TokenType::PLUS && isLiteralInt(l, 0)) || (op == TokenType::MULTIPLY && isLiteralInt(l, 1))) kept = r;
+        else if (((op == TokenType::PLUS || op == TokenType::MINUS) && isLiteralInt(r, 0))
+            || ((op == TokenType::MULTIPLY || op == TokenType::DIVIDE) && isLiteralInt(r, 1))) kept = l;
+        if (kept != -1 && staticInt(kept)) { folded++; return kept; }
+
+        // x * 0 only when evaluating x could neither fail nor have an effect
+        if (op == TokenType::MULTIPLY && (isLiteralInt(l, 0) || isLiteralInt(r, 0))){
+            NodeId other = isLiteralInt(l, 0) ? r : l;
+            if (pure(other) && staticInt(other)) { folded++; return ast.literal(Value::Int(0)); }
+        }
+        return e;
+    }
+    // every name declared (VAR_DECL without initializer) or used (IDENTIFIER) inside, in the order the compiler
+    // resolves them, tagged with the line of their statement
+    void names(NodeId id, int line, vector<NodeId>& out){
+        Node n = ast[id]; // a copy, add() may move the nodes
+        if (n.kind >= NodeKind::EXPR_STMT && n.kind <= NodeKind::WHILE) line = n.line; // a statement
+        NodeId name = -1;
+        switch (n.kind){
+            case NodeKind::IDENTIFIER: name = ast.add(NodeKind::IDENTIFIER, n.a); break;
+            case NodeKind::ASSIGN: names(n.b, line, out); name = ast.add(NodeKind::IDENTIFIER, n.a); break;
+            case NodeKind::VAR_DECL:
+                if (n.b >= 0) names(n.b, line, out);
+                name = ast.add(NodeKind::VAR_DECL, n.a, -1);
+                break;
+            case NodeKind::BINARY: case NodeKind::IF: case NodeKind::WHILE: names(n.a, line, out); names(n.b, line, out); break;
+            case NodeKind::UNARY: case NodeKind::EXPR_STMT: case NodeKind::PRINT: names(n.a, line, out); break;
+            case NodeKind::BLOCK:
+                for (int i = 0; i < n.b; i++) names(ast.lists[n.a + i], line, out);
+                break;
+            default: break;
+        }
+        if (name >= 0) { ast[name].line = line; out.push_back(name); }
+    }
+    // what is left of a body that never runs: its names, which the compiler still declares and checks
+    NodeId dropped(NodeId body){
+        folded++;
+        vector<NodeId> kept;
+        names(body, ast[body].line, kept);
+        NodeId block = ast.add(NodeKind::BLOCK, ast.lists.size(), kept.size());
+        ast.lists.insert(ast.lists.end(), kept.begin(), kept.end());
+        return block;
     }
-    void compile(Compiler& c){
-        assert(0 > 1);
+    NodeId stmt(NodeId s){
+        switch (ast[s].kind){
+            case NodeKind::EXPR_STMT: case NodeKind::PRINT: {
+                NodeId x = expr(ast[s].a);
+                ast[s].a = x;
+                return s;
+            }
+            case NodeKind::VAR_DECL: {
+                NodeId x = expr(ast[s].b);
+                ast[s].b = x;
+                setInt(ast[s].a, depth == 0 && staticInt(x));
+                return s;
+            }
+            case NodeKind::BLOCK:
+                for (int i = 0; i < ast[s].b; i++){
+                    NodeId x = stmt(ast.lists[ast[s].a + i]);
+                    ast.lists[ast[s].a + i] = x;
+                }
+                return s;
+            case NodeKind::IF: {
+                NodeId cond = expr(ast[s].a);
+                ast[s].a = cond;
+                if (isLiteralBool(cond, false)) return dropped(ast[s].b);
+                depth++;
+                NodeId body = stmt(ast[s].b);
+                ast[s].b = body;
+                depth--;
+                if (isLiteralBool(cond, true)) { folded++; return body; }
+                return s;
+            }
+            case NodeKind::WHILE: {
+                // the body runs again after its own assignments, so forget everything it writes before looking at it
+                vector<int> names;
+                assigns(s, names);
+                for (int n : names) setInt(n, false);
+                NodeId cond = expr(ast[s].a);
+                ast[s].a = cond;
+                if (isLiteralBool(cond, false)) return dropped(ast[s].b);
+                depth++;
+                NodeId body = stmt(ast[s].b);
+                ast[s].b = body;
+                depth--;
+                return s;
+            }
+            default: return s;
+        }
     }
 };
-struct AssignmentExpr : Expr {
-    string name;
-    Expr* valueExpr;
-    AssignmentExpr(string n, Expr* e) : name(n), valueExpr(e) {}
 
-    void compile(Compiler& c) {
-        valueExpr->compile(c); // Pushes value to stack
-        c.bytecode.push_back((int)Opcode::SET_LOCAL);
-        c.bytecode.push_back(c.varSlots[name]); // value stays on the stack.
-    }
+// Line table entry: the instructions from `offset` up to the next entry come from source line `line`.
+struct LineEntry {
+    int32_t offset;
+    int32_t line;
 };
-struct PrintStmt : Stmt {
-    Expr* expr;
-    PrintStmt(Expr* e) : expr(e) {}
 
-    void compile(Compiler& c) {
-        expr->compile(c);
-        c.bytecode.push_back((int)Opcode::PRINT);
+class Compiler {
+    public:
+    const Ast& ast;
+    vector<int> bytecode;
+    vector<LineEntry> lines;
+    int nextLocalSlot = 0;
+    vector<int> varSlots; // by name id, -1 until declared
+    int line = 0;         // of the statement being compiled
+
+    Compiler(const Ast& a) : ast(a) {}
+
+    Opcode opcodeFor(TokenType t) {
+        switch (t) {
+            case TokenType::PLUS: return Opcode::ADD;
+            case TokenType::MINUS: return Opcode::SUB;
+            case TokenType::MULTIPLY: return Opcode::MUL;
+            case TokenType::DIVIDE: return Opcode::DIV;
+            case TokenType::MOD: return Opcode::MOD;
+
+            case TokenType::EQUAL_EQUAL: return Opcode::EQUAL;
+            case TokenType::NOTEQUAL: return Opcode::NOTEQUAL;
+            case TokenType::LESS_THAN: return Opcode::LESSTHAN;
+            case TokenType::LESSEQUAL: return Opcode::LESSEQUAL;
+            case TokenType::GRTR_THAN: return Opcode::GRTRTHAN;
+            case TokenType::GRTREQL: return Opcode::GRTREQUAL;
+
+            default: assert(false);
+        }
+    }
+    int& slotOf(int name){
+        if (name >= (int)varSlots.size()) varSlots.resize(name + 1, -1);
+        return varSlots[name];
+    }
+    // slot of a name read or assigned; it must have been declared by an earlier let
+    int declaredSlot(int name){
+        int slot = slotOf(name);
+        if (slot < 0){
+            cerr << "Undefined variable '" << ast.names[name] << "' on line " << line << "\n";
+            exit(1);
+        }
+        return slot;
+    }
+    void emit(Opcode op){ bytecode.push_back((int)op); }
+    void emit(Opcode op, int operand){ bytecode.push_back((int)op); bytecode.push_back(operand); }
+    int emitJump(Opcode jumptype){ // returns the operand index to patch
+        emit(jumptype, 0); //temporary value
+        return bytecode.size() - 1;
+    }
+    void patchJump(int jumpInd){
+        bytecode[jumpInd] = bytecode.size();
     }
-};
-struct BlockStmt : Stmt {
-    vector<Stmt*> stmts;
-    BlockStmt(vector<Stmt*> v) : stmts(v) {}
 
-    void compile(Compiler& c){
-        for (auto stmt : stmts){
-            stmt->compile(c);
+    void compileExpr(NodeId e){
+        const Node& n = ast[e];
+        switch (n.kind){
+            case NodeKind::LITERAL:
+                if (n.value.isBool()) emit(n.value.asBool() ? Opcode::PUSH_TRUE : Opcode::PUSH_FALSE);
+                else emit(Opcode::PUSH, (int)n.value.asInt());
+                break;
+            case NodeKind::IDENTIFIER:
+                emit(Opcode::GET_LOCAL, declaredSlot(n.a));
+                break;
+            case NodeKind::STRING:
+                emit(Opcode::ALLOC_STRING, n.a); // ast.strings becomes the constant pool
+                break;
+            case NodeKind::BINARY:
+                compileExpr(n.a);
+                compileExpr(n.b);
+                emit(opcodeFor(n.op));
+                break;
+            case NodeKind::UNARY:
+                compileExpr(n.a);
+                if (n.op == TokenType::MINUS) emit(Opcode::NEG);
+                else if (n.op == TokenType::NOT) emit(Opcode::NOT);
+                break;
+            case NodeKind::ASSIGN:
+                compileExpr(n.b); // Pushes value to stack
+                emit(Opcode::SET_LOCAL, declaredSlot(n.a)); // value stays on the stack.
+                break;
+            default: break; // ERROR: nothing to emit
+        }
+    }
+    void compileStmt(NodeId s){
+        const Node& n = ast[s];
+        if (lines.empty() || lines.back().line != n.line){
+            if (!lines.empty() && lines.back().offset == (int)bytecode.size()) lines.pop_back(); // emitted nothing
+            lines.push_back({(int)bytecode.size(), n.line});
+        }
+        line = n.line;
+        switch (n.kind){
+            case NodeKind::EXPR_STMT:
+                compileExpr(n.a);
+                emit(Opcode::POP);
+                break;
+            case NodeKind::IDENTIFIER: // a name used in dead code (see Folder::dropped): only checked
+                declaredSlot(n.a);
+                break;
+            case NodeKind::VAR_DECL: // introduce a name and store a local value in the frame
+                if (n.b < 0) { slotOf(n.a) = nextLocalSlot++; break; } // declared in dead code: the slot stays nil
+                compileExpr(n.b); // push compiled value onto the stack
+                slotOf(n.a) = nextLocalSlot;
+                emit(Opcode::SET_LOCAL, nextLocalSlot++);
+                emit(Opcode::POP); // pop compiled value from stack
+                break;
+            case NodeKind::PRINT:
+                compileExpr(n.a);
+                emit(Opcode::PRINT);
+                break;
+            case NodeKind::BLOCK:
+                for (int i = 0; i < n.b; i++) compileStmt(ast.lists[n.a + i]);
+                break;
+            case NodeKind::IF: {
+                compileExpr(n.a);
+                int jumpIndex = emitJump(Opcode::JUMP_IF_FALSE);
+                compileStmt(n.b);
+                patchJump(jumpIndex); // backpatch the jump index
+                break;
+            }
+            case NodeKind::WHILE: {
+                int loopStart = bytecode.size();
+                compileExpr(n.a);
+                int jumpIndex = emitJump(Opcode::JUMP_IF_FALSE);
+                compileStmt(n.b);
+                emit(Opcode::JUMP, loopStart);
+                patchJump(jumpIndex);
+                break;
+            }
+            case NodeKind::ERROR:
+                assert(0 > 1);
+                break;
+            default: // a bare expression node where a statement was expected
+                compileExpr(s);
+                emit(Opcode::POP);
+                break;
         }
     }
 };
-struct IfStmt : Stmt {
-    Expr* cond;
-    Stmt* block;
-    IfStmt(Expr* e, Stmt* b) : cond(e), block(b) {}
 
-    int emitJump(Opcode jumptype, Compiler& c){
-        c.bytecode.push_back((int)jumptype);
-        return c.bytecode.size();
-    }
-    void patchJump(int jumpInd, Compiler& c){
-        c.bytecode[jumpInd] = c.bytecode.size();
+// Program text, mapped read-only. The front end reads it once from front to back, so pages behind the parser are
+// handed back with release() and a program far larger than memory is never resident all at once. Anything that
+// cannot be mapped (a pipe, an empty file) is read into `copy` instead.
+struct SourceFile {
+    static constexpr size_t RELEASE_CHUNK = 1 << 20;
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t mapped = 0;   // bytes of the mapping, 0 when reading from `copy`
+    size_t released = 0; // everything before this offset has been given back
+    string copy;
+
+    SourceFile() {}
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile(){ if (mapped) munmap((void*)data, mapped); }
+
+    bool load(const string& path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED){
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = (const char*)p;
+                size = mapped = st.st_size;
+                close(fd);
+                return true;
+            }
+        }
+        char buf[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) copy.append(buf, n);
+        close(fd);
+        data = copy.data();
+        size = copy.size();
+        return n == 0;
     }
-    void compile(Compiler& c){
-        cond->compile(c);
-        int jumpIndex = emitJump(Opcode::JUMP_IF_FALSE, c);
-        c.bytecode.push_back(0); //temporary value
-        block->compile(c);
-        patchJump(jumpIndex, c); // backpatch the jump index
+    string_view view() const { return string_view(data, size); }
+
+    // nothing before `offset` is read again; drops the whole pages behind it once a chunk's worth has built up
+    void release(size_t offset){
+        if (!mapped || offset < released + RELEASE_CHUNK) return;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t end = offset / page * page;
+        madvise((void*)(data + released), end - released, MADV_DONTNEED);
+        released = end;
     }
+    // about to read from the start again; released pages fault back in from the file
+    void rewind(){ released = 0; }
+};
+
+// Keywords resolve through a perfect hash computed at compile time: first byte, last byte and length pick one of 16
+// slots, and one string compare confirms the hit. The static_assert fails if a new keyword collides.
+struct Keyword {
+    string_view text;
+    TokenType type = TokenType::IDENTIFIER;
 };
-struct WhileStmt : Stmt {
-    Expr* cond;
-    Stmt* block;
-    WhileStmt(Expr* e, Stmt* b) : cond(e), block(b) {}
-
-    int emitJump(Opcode jumptype, Compiler& c){
-        c.bytecode.push_back((int)jumptype);
-        return c.bytecode.size();
-    }
-    void emitJump(Compiler& c, Opcode jumptype, int ls){
-        c.bytecode.push_back((int)Opcode::JUMP);
-        c.bytecode.push_back(ls);
-    }
-    void patchJump(int jumpInd, Compiler& c){
-        c.bytecode[jumpInd] = c.bytecode.size();
-    }
-    void compile(Compiler& c){
-        int loopStart = c.bytecode.size();
-        cond->compile(c);
-        int jumpIndex = emitJump(Opcode::JUMP_IF_FALSE, c);
-        c.bytecode.push_back(0); //temporary value
-        block->compile(c);
-        emitJump(c, Opcode::JUMP, loopStart);
-        patchJump(jumpIndex, c);
+
+constexpr Keyword keywordList[] = {
+    {"let", TokenType::LET}, {"fun", TokenType::FUN}, {"if", TokenType::IF}, {"else", TokenType::ELSE},
+    {"while", TokenType::WHILE}, {"return", TokenType::RETURN}, {"nil", TokenType::NIL}, {"true", TokenType::TRUE},
+    {"false", TokenType::FALSE}, {"print", TokenType::PRINT}
+};
+
+constexpr size_t keywordHash(string_view s){
+    return (2 * (unsigned char)s.front() + (unsigned char)s.back() + 5 * s.size()) & 15;
+}
+
+struct KeywordTable {
+    Keyword slots[16];
+
+    constexpr KeywordTable() : slots() {
+        for (const Keyword& k : keywordList) slots[keywordHash(k.text)] = k;
+    }
+    constexpr TokenType lookup(string_view s) const {
+        const Keyword& k = slots[keywordHash(s)];
+        return k.text == s ? k.type : TokenType::IDENTIFIER;
     }
 };
 
+constexpr KeywordTable keywords;
+
+constexpr bool keywordHashIsPerfect(){
+    for (const Keyword& k : keywordList) if (keywords.lookup(k.text) != k.type) return false;
+    return true;
+}
+static_assert(keywordHashIsPerfect(), "keywordHash collides, pick new multipliers");
+
+// Run scanners: each returns how many bytes from p (p < end) belong to the class. Most runs in real code are one or
+// two bytes (a single space, `i`, `0`), so the first SHORT_RUN bytes are checked one at a time; longer runs
+// (indentation, long names) continue 16 bytes per SSE2 step up to the first byte outside the class. The scalar
+// loop finishes the last partial block and is the whole implementation on other targets (or with -DVM_SCALAR_LEXER).
+constexpr int SHORT_RUN = 2;
+
+inline bool isIdentChar(char c){ return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'; }
+inline bool isDigitChar(char c){ return c >= '0' && c <= '9'; }
+inline bool isSpaceChar(char c){ return c == ' ' || c == '\n' || c == '\t' || c == '\r'; }
+
+#if defined(__SSE2__) && !defined(VM_SCALAR_LEXER)
+#define VM_SIMD_LEXER 1
+// signed byte compares, so bytes >= 0x80 never land in a range
+inline __m128i inRange(__m128i v, char lo, char hi){
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+inline unsigned identMask(__m128i v){
+    __m128i letter = inRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i ok = _mm_or_si128(_mm_or_si128(letter, inRange(v, '0', '9')), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    return _mm_movemask_epi8(ok);
+}
+inline unsigned digitMask(__m128i v){ return _mm_movemask_epi8(inRange(v, '0', '9')); }
+inline unsigned newlineMask(__m128i v){ return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))); }
+inline unsigned spaceMask(__m128i v){
+    __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    return _mm_movemask_epi8(ok);
+}
+#endif
+
+template <bool (*inClass)(char)
+#ifdef VM_SIMD_LEXER
+          , unsigned (*classMask)(__m128i)
+#endif
+          >
+size_t scanRun(const char* p, const char* end){
+    const char* q = p;
+    for (const char* stop = min(end, p + SHORT_RUN); q < stop; q++) if (!inClass(*q)) return q - p;
+#ifdef VM_SIMD_LEXER
+    while (end - q >= 16){
+        unsigned mask = classMask(_mm_loadu_si128((const __m128i*)q));
+        if (mask != 0xFFFF) return q - p + __builtin_ctz(~mask);
+        q += 16;
+    }
+#endif
+    while (q < end && inClass(*q)) q++;
+    return q - p;
+}
+
+#ifdef VM_SIMD_LEXER
+size_t scanIdentifier(const char* p, const char* end){ return scanRun<isIdentChar, identMask>(p, end); }
+size_t scanDigits(const char* p, const char* end){ return scanRun<isDigitChar, digitMask>(p, end); }
+#else
+size_t scanIdentifier(const char* p, const char* end){ return scanRun<isIdentChar>(p, end); }
+size_t scanDigits(const char* p, const char* end){ return scanRun<isDigitChar>(p, end); }
+#endif
+
+// whitespace also counts the newlines it skips
+size_t scanSpace(const char* p, const char* end, int& lines){
+    const char* q = p;
+    for (const char* stop = min(end, p + SHORT_RUN); q < stop; q++){
+        if (!isSpaceChar(*q)) return q - p;
+        if (*q == '\n') lines++;
+    }
+#ifdef VM_SIMD_LEXER
+    while (end - q >= 16){
+        __m128i v = _mm_loadu_si128((const __m128i*)q);
+        unsigned mask = spaceMask(v), newlines = newlineMask(v);
+        if (mask != 0xFFFF){
+            unsigned run = __builtin_ctz(~mask);
+            lines += __builtin_popcount(newlines & ((1u << run) - 1));
+            return q - p + run;
+        }
+        lines += __builtin_popcount(newlines);
+        q += 16;
+    }
+#endif
+    for (; q < end && isSpaceChar(*q); q++) if (*q == '\n') lines++;
+    return q - p;
+}
+
+// Tokens are views into the source buffer, which has to outlive them (and the parser that reads them). The lexer
+// produces one token per next() call, so only the parser's lookahead is ever held in memory.
 class Lexer {
     public:
-    int linenum;
-    string source;
-
-    Lexer(string src) : source(src), linenum(1) {}
-
-    unordered_map<string, TokenType> keywords = {
-        {"let", TokenType::LET},
-        {"fun", TokenType::FUN},
-        {"if", TokenType::IF},
-        {"else", TokenType::ELSE},
-        {"while", TokenType::WHILE},
-        {"return", TokenType::RETURN},
-        {"nil", TokenType::NIL},
-        {"print", TokenType::PRINT}
-    };
-    
-    vector<Token> tokens;
-    int index = 0;
+    int linenum = 1;
+    string_view source;
+    size_t index = 0;
 
-    // helper functions:
-    char peek(){
-        if (index + 1 < source.size()) return source[index + 1];
-        else { index++; return '\0'; }
-        index++;
-        return '\0';
-    }
-    char advance(){
-        if (index + 1 < source.size()) return source[index++];
-        else { index++; return '\0'; }
-        index++;
-        return '\0';
-    }
-    bool match(char c){
-        if (index + 1 < source.size()) {
-            if (source[index + 1] == c){
-                index++;
-                return true;
-            }
-            else return false;
+    Lexer(string_view src) : source(src) {}
+
+    Token make(TokenType type, size_t length){
+        Token tok{source.substr(index, length), linenum, type};
+        index += length;
+        return tok;
+    }
+    // "text": the lexeme is the text between the quotes, which may span lines. There are no escapes.
+    Token makeString(){
+        size_t close = source.find('"', index + 1);
+        if (close == string_view::npos){
+            cerr << "Unterminated string on line " << linenum << "\n";
+            close = source.size();
         }
-        index++;
-        return false;
+        Token tok{source.substr(index + 1, close - index - 1), linenum, TokenType::STRING};
+        linenum += count(tok.lexeme.begin(), tok.lexeme.end(), '\n');
+        index = min(close + 1, source.size());
+        return tok;
+    }
+    // one- or two-character operator: `c` alone, or `c=` as `withEqual`
+    Token makeOperator(TokenType alone, TokenType withEqual){
+        if (index + 1 < source.size() && source[index + 1] == '=') return make(withEqual, 2);
+        return make(alone, 1);
     }
 
-    vector<Token> scanTokens() {
+    // the next token, ENDOF (again and again) once the source is used up
+    Token next() {
+        const char* end = source.data() + source.size();
         while (index < source.size()){
-            if (source[index] == ' ') { index++; continue; }
-            else if (source[index] == '\n') { linenum++; index++; continue; }
-            else if (source[index] == '\t') { 
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '\t';
-                temp.type = TokenType::TAB;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (source[index] == '\r') { 
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '\r';
-                temp.type = TokenType::CARR_RETURN;
-                tokens.push_back(temp);
-                index++;
-            }
-
-            char c = source[index];
-            string tem;
-
-            if (c == '(') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '(';
-                temp.type = TokenType::LEFT_PAREN;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == ')') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = ')';
-                temp.type = TokenType::RIGHT_PAREN;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == ';') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = ';';
-                temp.type = TokenType::SEMICOLON;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '{') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '{';
-                temp.type = TokenType::LEFT_BRACE;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '}') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '}';
-                temp.type = TokenType::RIGHT_BRACE;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '[') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '[';
-                temp.type = TokenType::LEFT_BRACKET;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == ']') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = ']';
-                temp.type = TokenType::RIGHT_BRACKET;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '+') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '+';
-                temp.type = TokenType::PLUS;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '-') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '-';
-                temp.type = TokenType::MINUS;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '*') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '*';
-                temp.type = TokenType::MULTIPLY;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '/') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '/';
-                temp.type = TokenType::DIVIDE;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '%') {
-                Token temp;
-                temp.line = linenum;
-                temp.lexeme = '%';
-                temp.type = TokenType::MOD;
-                tokens.push_back(temp);
-                index++;
-            }
-            else if (c == '!'){
-                if (match('=')) {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = "!=";
-                    temp.type = TokenType::NOTEQUAL;
-                    tokens.push_back(temp);
-                    index++;
-                }
-                else {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = "!";
-                    temp.type = TokenType::NOT;
-                    tokens.push_back(temp);
-                    index++;
-                }
-            }
-            else if (c == '>'){
-                if (match('=')) {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = ">=";
-                    temp.type = TokenType::GRTREQL;
-                    tokens.push_back(temp);
-                    index++;
-                }
-                else {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = ">";
-                    temp.type = TokenType::GRTR_THAN;
-                    tokens.push_back(temp);
-                    index++;
-                }
-            }
-            else if (c == '<'){
-                if (match('=')) {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = "<=";
-                    temp.type = TokenType::LESSEQUAL;
-                    tokens.push_back(temp);
-                    index++;
-                }
-                else {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = "<";
-                    temp.type = TokenType::LESS_THAN;
-                    tokens.push_back(temp);
-                    index++;
-                }
-            }
-            else if (c == '='){
-                if (match('=')) {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = "==";
-                    temp.type = TokenType::EQUAL_EQUAL;
-                    tokens.push_back(temp);
+            const char* p = source.data() + index;
+            char c = *p;
+            switch (c){
+                case ' ': case '\n': case '\t': case '\r': index += scanSpace(p, end, linenum); continue;
+                case '(': return make(TokenType::LEFT_PAREN, 1);
+                case ')': return make(TokenType::RIGHT_PAREN, 1);
+                case '{': return make(TokenType::LEFT_BRACE, 1);
+                case '}': return make(TokenType::RIGHT_BRACE, 1);
+                case '[': return make(TokenType::LEFT_BRACKET, 1);
+                case ']': return make(TokenType::RIGHT_BRACKET, 1);
+                case ';': return make(TokenType::SEMICOLON, 1);
+                case ',': return make(TokenType::COMMA, 1);
+                case '+': return make(TokenType::PLUS, 1);
+                case '-': return make(TokenType::MINUS, 1);
+                case '*': return make(TokenType::MULTIPLY, 1);
+                case '/': return make(TokenType::DIVIDE, 1);
+                case '%': return make(TokenType::MOD, 1);
+                case '!': return makeOperator(TokenType::NOT, TokenType::NOTEQUAL);
+                case '>': return makeOperator(TokenType::GRTR_THAN, TokenType::GRTREQL);
+                case '<': return makeOperator(TokenType::LESS_THAN, TokenType::LESSEQUAL);
+                case '=': return makeOperator(TokenType::EQUAL, TokenType::EQUAL_EQUAL);
+                case '"': return makeString();
+                default:
+                    if (isDigitChar(c)) return make(TokenType::INTEGER, scanDigits(p, end));
+                    if (isIdentChar(c)){
+                        size_t length = scanIdentifier(p, end);
+                        return make(keywords.lookup(source.substr(index, length)), length);
+                    }
+                    cerr << "Unexpected character '" << c << "' on line " << linenum << "\n";
                     index++;
-                }
-                else {
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = "=";
-                    temp.type = TokenType::EQUAL;
-                    tokens.push_back(temp);
-                    index++;
-                }
             }
-            else {
-                if (isalpha(c) || c == '_'){
-                    int start = index;
-                    while (index < source.size() && (isalnum(peek()) || peek() == '_')) { index++; }
-                    index++;
+        }
+        return {"EOF", linenum, TokenType::ENDOF};
+    }
+};
 
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = source.substr(start, index-start);
-                    temp.type = TokenType::IDENTIFIER;
-                    if (keywords.count(temp.lexeme)) temp.type = keywords[temp.lexeme];
-                    tokens.push_back(temp);
-                }
-                else if (isdigit(c)){
-                    int start = index;
-                    while (index < source.size() && isdigit(peek())) index++;
-                    index++;
+// The parser's window on the token stream: a small ring holding the current token and the ones it has peeked
+// past, refilled from the lexer on demand. References stay valid until the parser moves LOOKAHEAD - 1 tokens on.
+struct TokenStream {
+    static constexpr size_t LOOKAHEAD = 4; // power of two
+    Lexer& lexer;
+    Token ring[LOOKAHEAD];
+    size_t head = 0, filled = 0; // tokens consumed / lexed so far
 
-                    Token temp;
-                    temp.line = linenum;
-                    temp.lexeme = source.substr(start, index-start);
-                    temp.type = TokenType::INTEGER;
-                    tokens.push_back(temp);
-                }
-            }
-        }
-        Token temp;
-        temp.line = linenum;
-        temp.lexeme = "EOF";
-        temp.type = TokenType::ENDOF;
-        tokens.push_back(temp);
+    TokenStream(Lexer& l) : lexer(l) {}
 
-        return tokens;
+    const Token& peek(size_t ahead = 0){
+        assert(ahead < LOOKAHEAD);
+        while (filled <= head + ahead) ring[filled++ & (LOOKAHEAD - 1)] = lexer.next();
+        return ring[(head + ahead) & (LOOKAHEAD - 1)];
+    }
+    void advance(){
+        peek();
+        head++;
     }
 };
 
 class Parser {
     public:
-    vector<Token> tokens;
-    int index;
-    Parser(vector<Token> t) : tokens(t), index(0) {}
+    TokenStream& tokens;
+    Ast& ast;
+    vector<NodeId> scratch; // statements of the blocks being parsed
+    Parser(TokenStream& t, Ast& a) : tokens(t), ast(a) {}
 
     // helper functions:
-    Token peek (){
-        if (index < tokens.size()) return tokens[index];
-        Token temp;
-        temp.type = TokenType::ENDOF;
-        return temp;
-    }
-    void advance(){
-        index++;
-    }
+    const Token& peek(){ return tokens.peek(); }
+    void advance(){ tokens.advance(); }
     bool match(TokenType t){
-        if (index < tokens.size() && tokens[index].type == t) { index++; return true; }
-        return false;
-    }
-    bool check(TokenType t){
-        if (index < tokens.size() && tokens[index].type == t) return true;
+        if (tokens.peek().type == t) { tokens.advance(); return true; }
         return false;
     }
-    Token nextCheck(){
-        if (index + 1 < tokens.size()) return tokens[index + 1];
-        Token temp;
-        temp.type = TokenType::ENDOF;
-        return temp;
-    }
-    vector<Stmt*> parseProgram() {
-        vector<Stmt*> stmts;
-        while (peek().type != TokenType::ENDOF){
-            stmts.push_back(parseStatement());
-        }
-        return stmts;
+    bool check(TokenType t){ return tokens.peek().type == t; }
+    const Token& nextCheck(){ return tokens.peek(1); }
+    bool atEnd(){ return tokens.peek().type == TokenType::ENDOF; }
+    NodeId parseStatement(){
+        int line = peek().line;
+        NodeId stmt = parseStatementBody();
+        ast[stmt].line = line;
+        return stmt;
     }
-    Stmt* parseStatement(){
+    NodeId parseStatementBody(){
         if (match(TokenType::PRINT)) {
-            Expr* value = parseExpression();
+            NodeId value = parseExpression();
             if (check(TokenType::SEMICOLON)) advance();
-            return new PrintStmt(value);
+            return ast.add(NodeKind::PRINT, value);
         }
         if (peek().type == TokenType::IDENTIFIER) {
             if (nextCheck().type == TokenType::EQUAL){
-                string temp = peek().lexeme;
+                int name = ast.name(peek().lexeme);
                 advance();
                 advance();
-                Stmt* stmt = new AssignmentStmt(temp, parseExpression());
+                NodeId value = parseExpression();
+                NodeId stmt = ast.add(NodeKind::EXPR_STMT, ast.add(NodeKind::ASSIGN, name, value));
                 if (peek().type == TokenType::SEMICOLON) advance();
                 return stmt;
             }
             else {
-                Stmt* stmt = new ExprStmt(parseExpression());
+                NodeId stmt = ast.add(NodeKind::EXPR_STMT, parseExpression());
                 if (peek().type == TokenType::SEMICOLON) advance();
                 return stmt;
             }
         }
         else if (match(TokenType::LET)){
             if (peek().type == TokenType::IDENTIFIER){
-                string temp = peek().lexeme;
+                int name = ast.name(peek().lexeme);
                 advance();
                 if (peek().type == TokenType::EQUAL) advance();
-                Stmt* stmt = new VarDeclStmt(temp, parseExpression());
+                NodeId init = parseExpression();
+                NodeId stmt = ast.add(NodeKind::VAR_DECL, name, init);
                 if (peek().type == TokenType::SEMICOLON) advance();
                 return stmt;
             }
         }
         else if (match(TokenType::IF)){
             if (match(TokenType::LEFT_PAREN)){
-                Expr* cond = parseExpression();
+                NodeId cond = parseExpression();
                 if (!match(TokenType::RIGHT_PAREN)) {
                     perror("Expected ')'");
                 }
                 
-                Stmt* block = parseStatement();
-                Stmt* ifstmt = new IfStmt(cond, block);
-                return ifstmt;
+                NodeId block = parseStatement();
+                return ast.add(NodeKind::IF, cond, block);
             }
             //else compiler error
         }
         else if (match(TokenType::WHILE)){
             if (match(TokenType::LEFT_PAREN)){
-                Expr* cond = parseExpression();
+                NodeId cond = parseExpression();
                 if (!match(TokenType::RIGHT_PAREN)) {
                     perror("Expected ')'");
                 }
                 
-                Stmt* block = parseStatement();
-                Stmt* whstmt = new WhileStmt(cond, block);
-                return whstmt;
+                NodeId block = parseStatement();
+                return ast.add(NodeKind::WHILE, cond, block);
             }
             // else compiler error
         }
         else if (match(TokenType::LEFT_BRACE)){
-            vector<Stmt*> stmts;
+            // children of nested blocks are collected on the same scratch stack and moved into ast.lists in one run
+            size_t mark = scratch.size();
             while (peek().type != TokenType::RIGHT_BRACE && peek().type != TokenType::ENDOF){
-                stmts.push_back(parseStatement());
+                NodeId stmt = parseStatement();
+                scratch.push_back(stmt);
             }
             advance(); //consume right brace
-            return new BlockStmt(stmts);
+            NodeId block = ast.add(NodeKind::BLOCK, ast.lists.size(), scratch.size() - mark);
+            ast.lists.insert(ast.lists.end(), scratch.begin() + mark, scratch.end());
+            scratch.resize(mark);
+            return block;
         }
         else //if (peek().type == TokenType::INTEGER) - WRONG, because statements can start with '-', '!', '(', etc, not just integers.
         {
-            Stmt* stmt = new ExprStmt(parseExpression());
+            NodeId stmt = ast.add(NodeKind::EXPR_STMT, parseExpression());
             if (peek().type == TokenType::SEMICOLON) advance();
             return stmt;
         }
         perror("Error: Unexpected token at statement");
         advance();
-        Stmt* error = new ErrorStmt(peek().line);
-        return error;
+        return ast.add(NodeKind::ERROR);
 
     }
 
-    Expr* parseExpression() {
+    NodeId parseExpression() {
     return parseAssignment(); // New top of the chain
     }
 
-    Expr* parseAssignment() {
-        Expr* expr = parseEquality(); // Fall through to math
+    NodeId parseAssignment() {
+        NodeId expr = parseEquality(); // Fall through to math
 
         if (match(TokenType::EQUAL)) {
-            Token equals = tokens[index - 1];
-            Expr* value = parseAssignment(); // Right-associative
+            NodeId value = parseAssignment(); // Right-associative
 
-            if (IdentifierExpr* i = dynamic_cast<IdentifierExpr*>(expr)) {
-                return new AssignmentExpr(i->name, value); // Change this to an EXPR
+            if (ast[expr].kind == NodeKind::IDENTIFIER) {
+                return ast.add(NodeKind::ASSIGN, ast[expr].a, value);
             }
             perror("Invalid assignment target.");
         }
 
         return expr;
     }
-    Expr* parseEquality(){
-        Expr* left = parseComparison();
+    NodeId parseEquality(){
+        NodeId left = parseComparison();
         while (check(TokenType::EQUAL_EQUAL) || check(TokenType::NOTEQUAL)){
             TokenType operand = peek().type;
             advance();
-            Expr* right = parseComparison();
+            NodeId right = parseComparison();
 
-            left = new BinaryExpr(left, operand, right); // reassigning it to left to support chaining
+            left = ast.add(NodeKind::BINARY, left, right, operand); // reassigning it to left to support chaining
         }
         return left;
     }
-    Expr* parseComparison(){
-        Expr* left = parseTerm();
+    NodeId parseComparison(){
+        NodeId left = parseTerm();
         while (check(TokenType::GRTR_THAN) || check(TokenType::GRTREQL) || check(TokenType::LESS_THAN) || check(TokenType::LESSEQUAL)){
             TokenType operand = peek().type;
             advance();
-            Expr* right = parseTerm();
+            NodeId right = parseTerm();
 
-            left = new BinaryExpr(left, operand, right); // reassigning it to left to support chains
+            left = ast.add(NodeKind::BINARY, left, right, operand); // reassigning it to left to support chains
         }
         return left;
     }
-    Expr* parseTerm(){
-        Expr* left = parseFactor();
+    NodeId parseTerm(){
+        NodeId left = parseFactor();
         while (check(TokenType::PLUS) || check(TokenType::MINUS)){
             TokenType operand = peek().type;
             advance();
-            Expr* right = parseFactor();
+            NodeId right = parseFactor();
 
-            left = new BinaryExpr(left, operand, right); // again, reassigning it to left to support chaining
+            left = ast.add(NodeKind::BINARY, left, right, operand); // again, reassigning it to left to support chaining
         }
         
         return left;
     }
-    Expr* parseFactor(){
-        Expr* left = parseUnary();
+    NodeId parseFactor(){
+        NodeId left = parseUnary();
         while (check(TokenType::MULTIPLY) || check(TokenType::DIVIDE) || check(TokenType::MOD)){
             TokenType operand = peek().type;
             advance();
-            Expr* right = parseUnary();
+            NodeId right = parseUnary();
 
-            left = new BinaryExpr(left, operand, right);
+            left = ast.add(NodeKind::BINARY, left, right, operand);
         }
         return left;
     }
-    Expr* parseUnary(){
+    NodeId parseUnary(){
         if (peek().type == TokenType::MINUS || peek().type == TokenType::NOT){
-            Token temp = peek();
+            TokenType op = peek().type;
             advance();
-            Expr* expr = parseUnary();
-            Expr* exp = new UnaryExpr(temp.type, expr);
-            return exp;
+            NodeId operand = parseUnary();
+            return ast.add(NodeKind::UNARY, operand, -1, op);
         }
         else return parsePrimary();
     }
-    Expr* parsePrimary(){
+    NodeId parsePrimary(){
         if (peek().type == TokenType::INTEGER){
-            int val = stoi(peek().lexeme);
+            string_view digits = peek().lexeme;
+            int val = 0;
+            if (from_chars(digits.data(), digits.data() + digits.size(), val).ec != errc()){
+                cerr << "Integer literal out of range on Line " << peek().line << "\n";
+                exit(1);
+            }
             advance();
-            Value value;
-            value.tag = ValueType::INT;
-            value.data.intVal = val;
-
-            Expr* expr = new LiteralExpr(value);
-            return expr; // this is a leaf node
+            return ast.literal(Value::Int(val)); // this is a leaf node
+        }
+        else if (peek().type == TokenType::TRUE || peek().type == TokenType::FALSE){
+            bool val = peek().type == TokenType::TRUE;
+            advance();
+            return ast.literal(Value::Bool(val));
         }
         else if (peek().type == TokenType::IDENTIFIER){
-            Token temp = peek();
+            int name = ast.name(peek().lexeme);
+            advance();
+            return ast.add(NodeKind::IDENTIFIER, name); //another leaf node
+        }
+        else if (peek().type == TokenType::STRING){
+            int index = ast.stringConstant(peek().lexeme);
             advance();
-            Expr* expr = new IdentifierExpr(temp.lexeme);
-            return expr; //another leaf node
+            return ast.add(NodeKind::STRING, index);
         }
         else if (peek().type == TokenType::LEFT_PAREN){
             advance();
-            Expr* expr = parseExpression();
+            NodeId expr = parseExpression();
             if (peek().type == TokenType::RIGHT_PAREN) { 
                 advance();
-                GroupingExpr* exp = new GroupingExpr(expr);
-                return exp;
+                return expr; // grouping only matters while parsing
             }
         }
-        int line = tokens[index].line;
-        Expr* error = new ErrorExpr(line);
+        int line = peek().line;
         cerr << "Expected Expression on Line " << line;
         advance();
-        return error;
+        return ast.add(NodeKind::ERROR);
     }
 };
 
-struct HeapObject {
+// A map's payload. Its hash table is an allocation of its own, so growing it never changes the map object's size
+// or handle. The table is Swiss-table style open addressing: one control byte per slot (EMPTY, DELETED, or 7 bits
+// of the key's hash), probed a group of 16 at a time, and the key/value pairs in a separate array. Free and
+// deleted pairs are nil, so the collector can scan the pairs like an array's elements.
+struct MapData {
+    uint8_t* ctrl;  // capacity + MAP_GROUP bytes; the table's allocation starts here
+    Value* slots;   // capacity key/value pairs
+    int32_t count;
+    int32_t growthLeft; // EMPTY slots that may still be filled before the table has to be rebuilt
+};
+
+// Every heap object is this header with its payload right behind it: the characters of a string, the elements
+// of an array or a map's MapData, so an object is a single allocation. Old objects live in size-classed slabs (see Heap).
+struct ObjHeader {
     HeapType type;
-    int size;
-    string st;
-    vector<Value> arr;
-    bool marked; // has reference from root (false -> destroyed, true -> alive)
-    bool free;
-
-    static HeapObject String(string str){
-        HeapObject ob;
-        ob.type = HeapType::STRING;
-        ob.st = str;
-        ob.size = str.size();
-        ob.marked = false;
-        ob.free = false;
-        return ob;
+    uint8_t sizeClass;       // old object: index into SIZE_CLASSES, or one of the *_CLASS constants below them
+    bool remembered;         // old array already in the remembered set
+    int32_t size;            // characters or elements; a map's capacity
+
+    static size_t elementBytes(HeapType type){
+        switch (type){
+            case HeapType::ARRAY: return sizeof(Value);
+            case HeapType::INT32_ARRAY: return sizeof(int32_t);
+            case HeapType::INT64_ARRAY: return sizeof(int64_t);
+            default: return 1; // characters, bools
+        }
     }
-    static HeapObject Array(int n){
-        HeapObject ob;
-        ob.type = HeapType::ARRAY;
-        ob.arr = vector<Value>(n, Value::Nil());
-        ob.size = n;
-        ob.marked = false;
-        ob.free = false;
-        return ob;
+    static size_t bytesFor(HeapType type, size_t size){
+        return sizeof(ObjHeader) + (type == HeapType::MAP ? sizeof(MapData) : size * elementBytes(type));
     }
-    private:
-        HeapObject(){}
-};
+    size_t bytes() const { return bytesFor(type, size); }
+    bool packed() const { return type >= HeapType::INT32_ARRAY && type <= HeapType::BOOL_ARRAY; }
+    // the Values the collector has to look at: an array's elements, a map's key/value pairs
+    bool scanned() const { return type == HeapType::ARRAY || type == HeapType::MAP; }
+    Value* refs(){ return type == HeapType::MAP ? map().slots : elements(); }
+    size_t refCount() const { return type == HeapType::MAP ? 2 * (size_t)size : size; }
+    MapData& map(){ return *(MapData*)(this + 1); }
+    Value* elements(){ return (Value*)(this + 1); }
+    char* chars(){ return (char*)(this + 1); }
+    string_view str(){ return string_view(chars(), size); }
+    template <class T> T* raw(){ return (T*)(this + 1); }
 
-struct callFrame {
-    int returnIP;
-    int frameBase;
-    vector<Value> locals;
-    callFrame(int ip, int fb) : returnIP(ip), frameBase(fb) {}
+    // packed element access, boxing and unboxing. An int64 element read back on a build with 32-bit ints wraps
+    // the way the VM's arithmetic does.
+    Value load(int i){
+        switch (type){
+            case HeapType::INT32_ARRAY: return Value::Int((vmint)raw<int32_t>()[i]);
+            case HeapType::INT64_ARRAY: return Value::Int((vmint)raw<int64_t>()[i]);
+            default: return Value::Bool(raw<uint8_t>()[i]);
+        }
+    }
+    void store(int i, const Value& v){
+        switch (type){
+            case HeapType::INT32_ARRAY:
+                assert(v.isInt() && v.asInt() >= INT32_MIN && v.asInt() <= INT32_MAX);
+                raw<int32_t>()[i] = v.asInt();
+                break;
+            case HeapType::INT64_ARRAY:
+                assert(v.isInt());
+                raw<int64_t>()[i] = v.asInt();
+                break;
+            default:
+                assert(v.isBool());
+                raw<uint8_t>()[i] = v.asBool();
+        }
+    }
 };
+static_assert(sizeof(ObjHeader) == 8 && sizeof(ObjHeader) % alignof(Value) == 0, "payload must follow the header aligned");
 
-struct VM {
-    int ip;
-    vector<Value> opst; // operand stack
-    vector<callFrame> callst; //call stack
-
-    vector<int> bc; //bytecode
-    vector<string> constants; // constant pool (for now)
+// Bulk kernels over packed arrays, behind the ARRAY_* opcodes. Int elements wrap at their own width. The int32
+// and bool loops go 16 bytes per SSE2 step and the int64 ones use SSE2 where it has the instruction (add, sub),
+// each finishing the tail one element at a time; with -DVM_SCALAR_KERNELS (or off x86) the scalar loops do all of it.
+// Copy and compare are memmove and memcmp, which the C library already vectorizes.
+#if defined(__SSE2__) && !defined(VM_SCALAR_KERNELS)
+#define VM_SIMD_KERNELS 1
+inline __m128i load16(const void* p){ return _mm_loadu_si128((const __m128i*)p); }
+inline void store16(void* p, __m128i v){ _mm_storeu_si128((__m128i*)p, v); }
+// SSE2 has no 32-bit min/max or low multiply (both are SSE4.1)
+inline __m128i select32(__m128i pickA, __m128i a, __m128i b){ return _mm_or_si128(_mm_and_si128(pickA, a), _mm_andnot_si128(pickA, b)); }
+inline __m128i mullo32(__m128i a, __m128i b){
+    __m128i even = _mm_mul_epu32(a, b), odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+inline int64_t sum64(__m128i v){
+    int64_t lanes[2];
+    store16(lanes, v);
+    return lanes[0] + lanes[1];
+}
+#endif
+
+void fillPacked(ObjHeader& a, const Value& v){
+    size_t n = a.size, i = 0;
+    switch (a.type){
+        case HeapType::INT32_ARRAY: {
+            assert(v.isInt() && v.asInt() >= INT32_MIN && v.asInt() <= INT32_MAX);
+            int32_t x = v.asInt(), *e = a.raw<int32_t>();
+#ifdef VM_SIMD_KERNELS
+            for (__m128i k = _mm_set1_epi32(x); i + 4 <= n; i += 4) store16(e + i, k);
+#endif
+            for (; i < n; i++) e[i] = x;
+            break;
+        }
+        case HeapType::INT64_ARRAY: {
+            assert(v.isInt());
+            int64_t x = v.asInt(), *e = a.raw<int64_t>();
+#ifdef VM_SIMD_KERNELS
+            for (__m128i k = _mm_set1_epi64x(x); i + 2 <= n; i += 2) store16(e + i, k);
+#endif
+            for (; i < n; i++) e[i] = x;
+            break;
+        }
+        default:
+            assert(v.isBool());
+            memset(a.raw<uint8_t>(), v.asBool(), n);
+    }
+}
+void copyPacked(ObjHeader& dst, ObjHeader& src){
+    assert(dst.type == src.type && dst.size >= src.size);
+    memmove(dst.raw<char>(), src.raw<char>(), (size_t)src.size * ObjHeader::elementBytes(src.type));
+}
+bool equalPacked(ObjHeader& a, ObjHeader& b){
+    return a.type == b.type && a.size == b.size && memcmp(a.raw<char>(), b.raw<char>(), (size_t)a.size * ObjHeader::elementBytes(a.type)) == 0;
+}
+int64_t sumPacked(ObjHeader& a){
+    size_t n = a.size, i = 0;
+    int64_t sum = 0;
+    switch (a.type){
+        case HeapType::INT32_ARRAY: {
+            const int32_t* e = a.raw<int32_t>();
+#ifdef VM_SIMD_KERNELS
+            __m128i acc = _mm_setzero_si128();
+            for (; i + 4 <= n; i += 4){ // sign-extend to two pairs of 64-bit lanes
+                __m128i x = load16(e + i), sign = _mm_srai_epi32(x, 31);
+                acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(x, sign), _mm_unpackhi_epi32(x, sign)));
+            }
+            sum = sum64(acc);
+#endif
+            for (; i < n; i++) sum += e[i];
+            break;
+        }
+        case HeapType::INT64_ARRAY: {
+            const int64_t* e = a.raw<int64_t>();
+            uint64_t u = 0; // wraps instead of overflowing
+#ifdef VM_SIMD_KERNELS
+            __m128i acc = _mm_setzero_si128();
+            for (; i + 2 <= n; i += 2) acc = _mm_add_epi64(acc, load16(e + i));
+            u = sum64(acc);
+#endif
+            for (; i < n; i++) u += e[i];
+            sum = u;
+            break;
+        }
+        default: { // number of trues
+            const uint8_t* e = a.raw<uint8_t>();
+#ifdef VM_SIMD_KERNELS
+            __m128i acc = _mm_setzero_si128();
+            for (; i + 16 <= n; i += 16) acc = _mm_add_epi64(acc, _mm_sad_epu8(load16(e + i), _mm_setzero_si128()));
+            sum = sum64(acc);
+#endif
+            for (; i < n; i++) sum += e[i];
+        }
+    }
+    return sum;
+}
+// smallest (or largest) element of a non-empty int array
+template <class T>
+T minMaxFrom(const T* e, size_t i, size_t n, T best, bool largest){ // one loop each, so neither tests `largest`
+    if (largest) for (; i < n; i++) best = max(best, e[i]);
+    else for (; i < n; i++) best = min(best, e[i]);
+    return best;
+}
+int64_t minMaxPacked(ObjHeader& a, bool largest){
+    size_t n = a.size;
+    assert(n > 0 && a.type != HeapType::BOOL_ARRAY);
+    if (a.type == HeapType::INT64_ARRAY) return minMaxFrom(a.raw<int64_t>(), 1, n, a.raw<int64_t>()[0], largest);
+    const int32_t* e = a.raw<int32_t>();
+    size_t i = 1;
+    int32_t best = e[0];
+#ifdef VM_SIMD_KERNELS
+    if (n >= 4){
+        __m128i acc = load16(e);
+        for (i = 4; i + 4 <= n; i += 4){
+            __m128i x = load16(e + i);
+            acc = select32(largest ? _mm_cmpgt_epi32(x, acc) : _mm_cmplt_epi32(x, acc), x, acc);
+        }
+        int32_t lanes[4];
+        store16(lanes, acc);
+        best = minMaxFrom(lanes, 1, 4, lanes[0], largest);
+    }
+#endif
+    return minMaxFrom(e, i, n, best, largest);
+}
+// every element = element op k, for op ADD, SUB or MUL
+void mapPacked(ObjHeader& a, Opcode op, vmint k){
+    assert(op == Opcode::ADD || op == Opcode::SUB || op == Opcode::MUL);
+    size_t n = a.size, i = 0;
+    auto apply = [op](auto x, auto y){ return op == Opcode::ADD ? x + y : op == Opcode::SUB ? x - y : x * y; };
+    if (a.type == HeapType::INT32_ARRAY){
+        uint32_t* e = a.raw<uint32_t>(); // unsigned, so it wraps
+#ifdef VM_SIMD_KERNELS
+        __m128i kk = _mm_set1_epi32((uint32_t)k);
+        for (; i + 4 <= n; i += 4){
+            __m128i x = load16(e + i);
+            store16(e + i, op == Opcode::ADD ? _mm_add_epi32(x, kk) : op == Opcode::SUB ? _mm_sub_epi32(x, kk) : mullo32(x, kk));
+        }
+#endif
+        for (; i < n; i++) e[i] = apply(e[i], (uint32_t)k);
+        return;
+    }
+    assert(a.type == HeapType::INT64_ARRAY);
+    uint64_t* e = a.raw<uint64_t>();
+#ifdef VM_SIMD_KERNELS
+    if (op != Opcode::MUL){
+        __m128i kk = _mm_set1_epi64x((int64_t)k);
+        for (; i + 2 <= n; i += 2){
+            __m128i x = load16(e + i);
+            store16(e + i, op == Opcode::ADD ? _mm_add_epi64(x, kk) : _mm_sub_epi64(x, kk));
+        }
+    }
+#endif
+    for (; i < n; i++) e[i] = apply(e[i], (uint64_t)(int64_t)k);
+}
+
+// Generational heap. Handles index a table of object pointers: from NURSERY_BASE up they name nursery objects, the
+// ones below it old objects. New objects are bump-allocated in the nursery, a fixed block of bytes with a fixed
+// number of handles. When either runs out a minor collection copies the survivors into the old generation and
+// starts the nursery over, so dead young objects are never visited (they are simply overwritten). Survivors are found from the roots and from the remembered set: old arrays
+// that SET_INDEX saw storing a nursery handle. The old generation is mark-and-sweep and paced in bytes, GOGC-style:
+// a collection of it starts once it has grown by `growthPercent` over what survived the last one (see setNextFull).
+//
+// Old-generation collections can be incremental (a pause target is set): the cycle then advances by one slice per
+// minor collection, each slice marking or sweeping until the target is used up. Marking is tri-color over the
+// mark bitmap (white: unmarked, grey: marked and still on `grey`, black: marked and scanned) and snapshot-at-the-
+// beginning: the roots are greyed when the cycle starts, and while it marks, SET_INDEX greys the old value it
+// overwrites, so everything reachable at the start gets marked even if the program unlinks it in between.
+// Objects promoted during the cycle start out black. A cycle that runs in one pause marks on `markThreads`
+// threads once the old generation is big enough to be worth it (see markParallel).
+//
+// Old objects are carved out of 64K slabs, one size class per slab; a swept cell goes on its class's free list
+// and is handed out again before the slab is bumped. Objects bigger than the largest class get an allocation of
+// their own; they still start out young (only their bytes count against the nursery), and promoting one just
+// moves its pointer into the old handle table. Those bigger than PRETENURE_BYTES go straight to the old generation,
+// each in a mapping of its own: fresh zero pages are already nil or 0, so nothing is written until the program
+// does, and the sweep unmaps it, so a spike of huge arrays gives its memory back as soon as it is collected.
+constexpr int NURSERY_BASE = 1 << 30;
+constexpr int NURSERY_SLOTS = 1 << 12;
+constexpr size_t NURSERY_BYTES = 1 << 18;
+constexpr uint32_t SIZE_CLASSES[] = {16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+                                     4096, 6144, 8192};
+constexpr int CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+constexpr uint32_t LARGEST_CELL = SIZE_CLASSES[CLASS_COUNT - 1];
+constexpr uint8_t LARGE_CLASS = 255;
+constexpr uint8_t PERMANENT_CLASS = 254; // in the read-only region of constant-pool objects
+constexpr uint8_t MAPPED_CLASS = 253;    // bigger than PRETENURE_BYTES, in a mapping of its own
+constexpr size_t SLAB_BYTES = 1 << 16;
+constexpr size_t PRETENURE_BYTES = NURSERY_BYTES / 4;
+constexpr size_t COMPACT_MIN_BYTES = 8 << 20;
+constexpr size_t COMPACT_RATIO = 4;
+constexpr size_t GC_MIN_HEAP = 4 << 20;     // no full collection of an old generation smaller than this
+constexpr size_t GC_MIN_HEADROOM = 1 << 20; // growth allowed between full collections even at the soft limit
+
+enum class GcPhase { IDLE, MARKING, SWEEPING };
+
+struct GcConfig {
+    bool stats = false;       // --gc-stats
+    double pauseTargetUs = 0; // --gc-pause; 0 collects the old generation in one pause
+    int threads = max(1u, min(8u, thread::hardware_concurrency())); // --gc-threads, for stop-the-world marking
+    int growthPercent = 100;  // --gc-growth; -1 (off) leaves full collections to the limits
+    size_t softLimit = 0;     // --gc-soft-limit, bytes; 0 for none
+    size_t hardLimit = 0;     // --gc-hard-limit, bytes; 0 for none
+};
+
+// Mark bits of the old generation, one per handle and kept apart from the objects, so that parallel markers claim
+// an object with a single fetch_or. Only grows while no marker runs.
+struct MarkBitmap {
+    unique_ptr<atomic<uint64_t>[]> words;
+    size_t capacity = 0; // in bits
+
+    void ensure(size_t bits){
+        if (bits <= capacity) return;
+        size_t n = max(bits, capacity * 2) / 64 + 1;
+        unique_ptr<atomic<uint64_t>[]> grown(new atomic<uint64_t>[n]);
+        for (size_t i = 0; i < n; i++) grown[i].store(i < capacity / 64 ? words[i].load(memory_order_relaxed) : 0, memory_order_relaxed);
+        words = move(grown);
+        capacity = n * 64;
+    }
+    bool test(int h) const { return words[h >> 6].load(memory_order_relaxed) >> (h & 63) & 1; }
+    // true if this call set it
+    bool set(int h){
+        uint64_t bit = 1ull << (h & 63);
+        return !(words[h >> 6].fetch_or(bit, memory_order_relaxed) & bit);
+    }
+    void clear(int h){ words[h >> 6].fetch_and(~(1ull << (h & 63)), memory_order_relaxed); }
+};
+
+// Map tables. Keys hash by Value: ints and bools by number (valuesEqual says 1 == true, so they are one key),
+// strings by handle, which is their content since strings are interned and permanent. Other objects would need
+// rehashing whenever the collector moves them, so they cannot be keys. A table is rebuilt once 7/8 of its slots
+// have been used; twice as big unless deletions left at least half of them as tombstones.
+constexpr int MAP_GROUP = 16;
+constexpr uint8_t CTRL_EMPTY = 0x80, CTRL_DELETED = 0xFE; // full slots hold 7 hash bits, so their top bit is clear
+
+uint64_t hashKey(const Value& k){
+    uint64_t x = k.isNumber() ? (uint64_t)(int64_t)k.asNumber() : k.isNil() ? 0x5bd1e995 : ((uint64_t)k.asHandle() << 32 | 1);
+    x ^= x >> 33; // murmur3 finalizer
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+size_t mapTableBytes(size_t capacity){
+    return ((capacity + MAP_GROUP + 7) & ~(size_t)7) + capacity * 2 * sizeof(Value);
+}
+size_t mapCapacityFor(size_t entries){ // smallest power of two, at least a group, that holds `entries` under 7/8 load
+    size_t capacity = MAP_GROUP;
+    while (capacity * 7 / 8 < entries) capacity *= 2;
+    return capacity;
+}
+
+// bit i set: byte i of the group at `g` is `b` (matchByte) or has its top bit set, i.e. is EMPTY or DELETED (matchFree)
+#ifdef VM_SIMD_KERNELS
+inline unsigned matchByte(const uint8_t* g, uint8_t b){ return _mm_movemask_epi8(_mm_cmpeq_epi8(load16(g), _mm_set1_epi8(b))); }
+inline unsigned matchFree(const uint8_t* g){ return _mm_movemask_epi8(load16(g)); }
+#else
+inline unsigned matchByte(const uint8_t* g, uint8_t b){
+    unsigned m = 0;
+    for (int i = 0; i < MAP_GROUP; i++) m |= (unsigned)(g[i] == b) << i;
+    return m;
+}
+inline unsigned matchFree(const uint8_t* g){
+    unsigned m = 0;
+    for (int i = 0; i < MAP_GROUP; i++) m |= (unsigned)(g[i] >> 7) << i;
+    return m;
+}
+#endif
+
+// Probes run over groups starting anywhere in the table: the first MAP_GROUP control bytes are mirrored past the
+// end, so a group never wraps. Groups are visited at triangular offsets, which covers the whole table.
+struct MapProbe {
+    size_t mask, pos, step = 0;
+    MapProbe(uint64_t hash, size_t capacity) : mask(capacity - 1), pos((hash >> 7) & mask) {}
+    void next(){ step += MAP_GROUP; pos = (pos + step) & mask; }
+};
+inline uint8_t hashTag(uint64_t hash){ return hash & 0x7F; }
+
+// slot holding `key`, or -1
+int mapFind(ObjHeader& m, const Value& key, uint64_t hash){
+    MapData& d = m.map();
+    for (MapProbe p(hash, m.size);; p.next()){
+        const uint8_t* g = d.ctrl + p.pos;
+        for (unsigned bits = matchByte(g, hashTag(hash)); bits; bits &= bits - 1){
+            size_t i = (p.pos + __builtin_ctz(bits)) & p.mask;
+            if (valuesEqual(d.slots[2 * i], key)) return i;
+        }
+        if (matchByte(g, CTRL_EMPTY)) return -1;
+    }
+}
+void setCtrl(ObjHeader& m, size_t i, uint8_t c){
+    MapData& d = m.map();
+    d.ctrl[i] = c;
+    if (i < MAP_GROUP) d.ctrl[m.size + i] = c;
+}
+// claims the first EMPTY or DELETED slot on `key`'s probe sequence, for a key that is not in the table; the caller
+// has made sure there is room. Returns the slot, whose pair the caller fills in.
+int mapClaim(ObjHeader& m, uint64_t hash){
+    MapData& d = m.map();
+    for (MapProbe p(hash, m.size);; p.next()){
+        if (unsigned bits = matchFree(d.ctrl + p.pos)){
+            size_t i = (p.pos + __builtin_ctz(bits)) & p.mask;
+            if (d.ctrl[i] == CTRL_EMPTY) d.growthLeft--;
+            setCtrl(m, i, hashTag(hash));
+            d.count++;
+            return i;
+        }
+    }
+}
+void mapErase(ObjHeader& m, size_t i){
+    MapData& d = m.map();
+    setCtrl(m, i, CTRL_DELETED);
+    d.slots[2 * i] = d.slots[2 * i + 1] = Value::Nil();
+    d.count--;
+}
+// an empty table of `capacity` slots for map `m`, which must not hold one
+void mapInit(ObjHeader& m, size_t capacity){
+    char* table = (char*)malloc(mapTableBytes(capacity));
+    if (!table) { perror("malloc map table"); exit(1); }
+    MapData& d = m.map();
+    d.ctrl = (uint8_t*)table;
+    d.slots = (Value*)(table + ((capacity + MAP_GROUP + 7) & ~(size_t)7));
+    d.count = 0;
+    d.growthLeft = capacity * 7 / 8;
+    m.size = capacity;
+    memset(d.ctrl, CTRL_EMPTY, capacity + MAP_GROUP);
+    memset((void*)d.slots, 0, capacity * 2 * sizeof(Value)); // nil
+}
+
+struct GcStats {
+    long long minor = 0, major = 0, promoted = 0, compactions = 0;
+    double ms = 0, markMs = 0; // markMs: marking done in one pause, the part markThreads speeds up
+    size_t peakBytes = 0, liveBytes = 0, peakMappedBytes = 0;
+    vector<float> pauses; // microseconds, one per collection pause
+
+    void report(ostream& out) const {
+        vector<float> sorted = pauses;
+        sort(sorted.begin(), sorted.end());
+        float maxPause = sorted.empty() ? 0 : sorted.back();
+        float p99 = sorted.empty() ? 0 : sorted[(sorted.size() * 99 + 99) / 100 - 1];
+        out << "gc: " << minor << " minor, " << major << " full, " << compactions << " compacting, " << promoted << " objects promoted, " << fixed
+            << setprecision(3) << ms << " ms (" << markMs << " ms stop-the-world marking)\n"
+            << "gc pauses: " << pauses.size() << ", max " << maxPause / 1000 << " ms, p99 " << p99 / 1000 << " ms\n"
+            << "gc old generation: peak " << peakBytes / 1048576.0 << " MB, " << liveBytes / 1048576.0 << " MB after the last full collection\n";
+    }
+};
+
+char* mapBytes(size_t bytes, const char* what){
+    void* m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) { perror(what); exit(1); }
+    return (char*)m;
+}
+
+struct Heap {
+    deque<ObjHeader*> old;          // null for a free handle. A deque, so growing it never copies inside a pause
+    queue<int> freeOld;             // swept old handles, reused before `old` grows
+    struct SizeClass {
+        char* freeCells = nullptr;  // swept cells, each holding a pointer to the next
+        char* bump = nullptr;       // unused rest of the newest slab
+        char* end = nullptr;
+    } classes[CLASS_COUNT];
+    vector<char*> slabs;
+    size_t cellBytes = 0;           // handed-out slab cells
+
+    char* nurseryBytes;
+    size_t nurseryUsed = 0;
+    ObjHeader* nursery[NURSERY_SLOTS]; // slot i is handle NURSERY_BASE + i
+    int forward[NURSERY_SLOTS];        // promoted nursery object: its old handle, else -1
+    int top = 0;
+    vector<int> largeYoung;            // nursery slots of objects with an allocation of their own
+    vector<int> youngMaps;             // nursery slots of maps, whose tables are freed if they die young
+    char* permanentBytes = nullptr;    // read-only once filled in
+    size_t permanentSize = 0;
+    int permanent = 0;                 // old handles below it are permanent: never swept, moved or counted
+    vector<int> remembered;
+    int liveAfterFull = 0;                                 // objects that survived the last full collection
+    size_t largeBytes = 0;                                 // old objects malloc'd on their own
+    size_t mappedBytes = 0, mappedObjects = 0;             // old objects in a mapping of their own, page-rounded
+    size_t mapTables = 0;                                  // bytes of all maps' tables, young ones included
+    size_t liveBytesAfterFull = 0, nextFull = GC_MIN_HEAP; // old-generation bytes
+    int growthPercent = 100;
+    size_t softLimit = 0, hardLimit = 0;
+
+    GcPhase phase = GcPhase::IDLE;
+    MarkBitmap marks;
+    vector<int> grey;
+    size_t sweepCursor = 0; // old slots below it have been swept this cycle
+    int sweptLive = 0;
+    double pauseTargetUs = 0;
+    int markThreads = 1;
+    GcStats stats;
+
+    Heap() : nurseryBytes(mapBytes(NURSERY_BYTES, "mmap nursery")) {}
+    ~Heap(){
+        for (ObjHeader* ob : old){
+            if (ob && ob->type == HeapType::MAP) free(ob->map().ctrl);
+            if (ob && ob->sizeClass == LARGE_CLASS) free(ob);
+            else if (ob && ob->sizeClass == MAPPED_CLASS) munmap(ob, mappedSize(ob->bytes()));
+        }
+        for (int slot : youngMaps) if (forward[slot] == -1) free(nursery[slot]->map().ctrl);
+        for (int slot : largeYoung) if (forward[slot] == -1) free(nursery[slot]);
+        for (char* slab : slabs) munmap(slab, SLAB_BYTES);
+        munmap(nurseryBytes, NURSERY_BYTES);
+        if (permanentBytes) munmap(permanentBytes, permanentSize);
+    }
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    static bool young(int h){ return h >= NURSERY_BASE; }
+    static uint8_t classFor(size_t bytes){
+        return lower_bound(begin(SIZE_CLASSES), end(SIZE_CLASSES), bytes) - begin(SIZE_CLASSES);
+    }
+    ObjHeader& operator[](int h){ return young(h) ? *nursery[h - NURSERY_BASE] : *old[h]; }
+    // true if a new object of `bytes` has to wait for a collection: the nursery has no room for it, or it goes
+    // straight (`tenured`, as map tables do, or too big for the nursery) to an old generation that is due
+    bool needsCollection(size_t bytes, bool tenured = false) const {
+        if (tenured || bytes > PRETENURE_BYTES) return oldFull() || overLimit(bytes);
+        return top == NURSERY_SLOTS || nurseryUsed + bytes > NURSERY_BYTES;
+    }
+    // header filled in, payload left to the caller
+    int allocate(HeapType type, int size){
+        size_t bytes = ObjHeader::bytesFor(type, size);
+        if (bytes > PRETENURE_BYTES) return allocateOld(type, size);
+        assert(!needsCollection(bytes));
+        ObjHeader* ob;
+        if (bytes > LARGEST_CELL){
+            ob = allocateLarge(bytes);
+            largeYoung.push_back(top);
+        }
+        else ob = (ObjHeader*)(nurseryBytes + nurseryUsed);
+        nurseryUsed += (bytes + 7) & ~(size_t)7;
+        *ob = ObjHeader{type, bytes > LARGEST_CELL ? LARGE_CLASS : (uint8_t)0, false, size};
+        nursery[top] = ob;
+        forward[top] = -1;
+        return NURSERY_BASE + top++;
+    }
+    int allocateArray(int n){
+        int h = allocate(HeapType::ARRAY, n);
+        ObjHeader& arr = (*this)[h];
+        if (arr.sizeClass != MAPPED_CLASS) fill(arr.elements(), arr.elements() + n, Value::Nil());
+        return h;
+    }
+    int allocatePacked(HeapType type, int n){ // zeroed: 0 or false
+        int h = allocate(type, n);
+        ObjHeader& arr = (*this)[h];
+        if (arr.sizeClass != MAPPED_CLASS) memset(arr.chars(), 0, (size_t)n * ObjHeader::elementBytes(type));
+        return h;
+    }
+    int allocateMap(size_t capacity){
+        int h = allocate(HeapType::MAP, 0);
+        mapInit((*this)[h], capacity);
+        mapTables += mapTableBytes(capacity);
+        if (young(h)) youngMaps.push_back(h - NURSERY_BASE);
+        return h;
+    }
+    // rebuild map `h`'s table at `capacity`, dropping its tombstones
+    void rehashMap(int h, size_t capacity){
+        ObjHeader& m = (*this)[h];
+        MapData old = m.map();
+        size_t oldCapacity = m.size;
+        mapInit(m, capacity);
+        for (size_t i = 0; i < oldCapacity; i++){
+            if (old.ctrl[i] & 0x80) continue;
+            const Value& key = old.slots[2 * i];
+            int j = mapClaim(m, hashKey(key));
+            m.map().slots[2 * j] = key;
+            m.map().slots[2 * j + 1] = old.slots[2 * i + 1];
+        }
+        free(old.ctrl);
+        mapTables += mapTableBytes(capacity);
+        mapTables -= mapTableBytes(oldCapacity);
+    }
+    void freeMapTable(ObjHeader& m){
+        mapTables -= mapTableBytes(m.size);
+        free(m.map().ctrl);
+    }
+    // Before the program starts: one string per distinct constant, packed into a single mapping that is then made
+    // read-only, with handles 0..permanent-1. These are all the strings a program has, and none is ever freed, so
+    // interning them is this one pass and == on strings can compare handles. Their mark bits stay set, so the
+    // marker passes over them as already black and the sweep starts after them. `handles` gets each constant's
+    // handle, for ALLOC_STRING to push.
+    void makePermanent(const vector<string>& constants, vector<int>& handles){
+        assert(old.empty() && !permanentBytes);
+        unordered_map<string_view, int> interned; // listings and .vmb pools may repeat a string; size distinct ones
+        for (const string& c : constants)
+            if (interned.emplace(c, 0).second) permanentSize += (ObjHeader::bytesFor(HeapType::STRING, c.size()) + 7) & ~(size_t)7;
+        if (permanentSize == 0) return;
+        permanentSize = (permanentSize + 4095) & ~(size_t)4095;
+        permanentBytes = mapBytes(permanentSize, "mmap constants");
+        char* next = permanentBytes;
+        interned.clear();
+        for (const string& c : constants){
+            auto [it, added] = interned.emplace(c, old.size());
+            if (added){
+                ObjHeader* ob = (ObjHeader*)next;
+                *ob = ObjHeader{HeapType::STRING, PERMANENT_CLASS, false, (int32_t)c.size()};
+                memcpy(ob->chars(), c.data(), c.size());
+                next += (ob->bytes() + 7) & ~(size_t)7;
+                old.push_back(ob);
+            }
+            handles.push_back(it->second);
+        }
+        if (mprotect(permanentBytes, permanentSize, PROT_READ) != 0) { perror("mprotect constants"); exit(1); }
+        permanent = old.size();
+        markPermanent();
+    }
+    void markPermanent(){
+        marks.ensure(old.size());
+        for (int h = 0; h < permanent; h++) marks.set(h);
+    }
+    char* allocateCell(uint8_t c){
+        SizeClass& sc = classes[c];
+        cellBytes += SIZE_CLASSES[c];
+        if (char* cell = sc.freeCells) {
+            sc.freeCells = *(char**)cell;
+            return cell;
+        }
+        if (sc.bump + SIZE_CLASSES[c] > sc.end){
+            sc.bump = mapBytes(SLAB_BYTES, "mmap heap slab");
+            sc.end = sc.bump + SLAB_BYTES / SIZE_CLASSES[c] * SIZE_CLASSES[c];
+            slabs.push_back(sc.bump);
+        }
+        char* cell = sc.bump;
+        sc.bump += SIZE_CLASSES[c];
+        return cell;
+    }
+    static ObjHeader* allocateLarge(size_t bytes){
+        ObjHeader* ob = (ObjHeader*)malloc(bytes);
+        if (!ob) { perror("malloc heap object"); exit(1); }
+        return ob;
+    }
+    static size_t mappedSize(size_t bytes){ return (bytes + 4095) & ~(size_t)4095; }
+    // payload all zero bits, which reads as nil, 0 or false
+    ObjHeader* allocateMapped(size_t bytes){
+        mappedBytes += mappedSize(bytes);
+        mappedObjects++;
+        stats.peakMappedBytes = max(stats.peakMappedBytes, mappedBytes);
+        return (ObjHeader*)mapBytes(mappedSize(bytes), "mmap large object");
+    }
+    int allocateOld(HeapType type, int size){
+        size_t bytes = ObjHeader::bytesFor(type, size);
+        uint8_t c = bytes > PRETENURE_BYTES ? MAPPED_CLASS : bytes > LARGEST_CELL ? LARGE_CLASS : classFor(bytes);
+        ObjHeader* ob = c == MAPPED_CLASS ? allocateMapped(bytes) : c == LARGE_CLASS ? allocateLarge(bytes) : (ObjHeader*)allocateCell(c);
+        *ob = ObjHeader{type, c, false, size};
+        return adopt(ob);
+    }
+    // give `ob` an old handle
+    int adopt(ObjHeader* ob){
+        if (ob->sizeClass == LARGE_CLASS) largeBytes += ob->bytes();
+        int h;
+        if (freeOld.empty()) { h = old.size(); old.push_back(ob); }
+        else {
+            h = freeOld.front();
+            freeOld.pop();
+            old[h] = ob;
+        }
+        // allocated black while marking; while sweeping, slots the sweep has yet to reach must survive it
+        marks.ensure(old.size());
+        if (phase == GcPhase::MARKING || (phase == GcPhase::SWEEPING && (size_t)h >= sweepCursor)) marks.set(h);
+        else marks.clear(h);
+        return h;
+    }
+    // sweep found old object `h` dead. Only its header is touched (the free list link overwrites it), and a map's
+    // table pointer.
+    void release(int h){
+        ObjHeader* ob = old[h];
+        assert(h >= permanent);
+        if (ob->type == HeapType::MAP) freeMapTable(*ob);
+        uint8_t c = ob->sizeClass;
+        if (c == LARGE_CLASS) {
+            largeBytes -= ob->bytes();
+            free(ob);
+        }
+        else if (c == MAPPED_CLASS) {
+            mappedBytes -= mappedSize(ob->bytes());
+            mappedObjects--;
+            munmap(ob, mappedSize(ob->bytes()));
+        }
+        else {
+            *(char**)ob = classes[c].freeCells;
+            classes[c].freeCells = (char*)ob;
+            cellBytes -= SIZE_CLASSES[c];
+        }
+        old[h] = nullptr;
+        freeOld.push(h);
+    }
+    void shade(const Value& v){
+        if (!v.isObject() || young(v.asHandle()) || !marks.set(v.asHandle())) return;
+        if (old[v.asHandle()]->scanned()) grey.push_back(v.asHandle());
+    }
+    // write barrier: SET_INDEX just replaced `previous` with `value` in array `h` (or a map op did, in map `h`)
+    void recordWrite(int h, const Value& previous, const Value& value){
+        if (young(h)) return;
+        if (phase == GcPhase::MARKING) shade(previous);
+        if (!value.isObject() || !young(value.asHandle()) || old[h]->remembered) return;
+        old[h]->remembered = true;
+        remembered.push_back(h);
+    }
+    size_t oldBytes() const { return cellBytes + largeBytes + mappedBytes + mapTables; }
+    // --gc-stats: what each space of the old generation holds at exit
+    void reportSpaces(ostream& out) const {
+        size_t slabBytes = slabs.size() * SLAB_BYTES;
+        out << fixed << setprecision(3) << "gc spaces: slabs " << slabBytes / 1048576.0 << " MB (" << cellBytes / 1048576.0
+            << " MB in use), malloc'd objects " << largeBytes / 1048576.0 << " MB, mapped objects " << mappedObjects << " in "
+            << mappedBytes / 1048576.0 << " MB (peak " << stats.peakMappedBytes / 1048576.0 << " MB), constants "
+            << permanentSize / 1048576.0 << " MB, map tables " << mapTables / 1048576.0 << " MB\n";
+    }
+    bool oldFull() const { return oldBytes() >= nextFull; }
+    // a cycle in progress has let the old generation grow twice as much as it was meant to
+    bool behind() const { return oldBytes() > liveBytesAfterFull + 2 * (nextFull - liveBytesAfterFull); }
+    bool overLimit(size_t incoming = 0) const { return hardLimit && oldBytes() + incoming > hardLimit; }
+    // after a full collection: the next one starts once the old generation has grown by growthPercent over what
+    // survived this one. Near the soft limit that comes sooner, but never so soon that collections run back to back.
+    void setNextFull(){
+        size_t live = liveBytesAfterFull;
+        nextFull = growthPercent < 0 ? SIZE_MAX : max(GC_MIN_HEAP, live + live / 100 * growthPercent);
+        if (softLimit) nextFull = max(min(nextFull, softLimit), live + max(live / 8, GC_MIN_HEADROOM));
+    }
+    // right after a full collection: mostly free slabs or handles, and more than the old generation will fill
+    // again before the next one (nextFull), as left behind by a spike that is gone again
+    bool fragmented() const {
+        size_t slabBytes = slabs.size() * SLAB_BYTES, handles = old.size();
+        size_t minHandles = COMPACT_MIN_BYTES / sizeof(ObjHeader*);
+        return (slabBytes > COMPACT_MIN_BYTES && slabBytes - COMPACT_MIN_BYTES > max(nextFull, COMPACT_RATIO * cellBytes))
+            || (handles > minHandles && handles - minHandles > max(nextFull / SIZE_CLASSES[0], COMPACT_RATIO * liveAfterFull));
+    }
+};
+
+struct callFrame { // just a header: the frame's locals live on the operand stack at [frameBase, frameBase + slotCount)
+    int returnIP;
+    int frameBase;
+    int slotCount;
+    callFrame(int ip, int fb, int slots) : returnIP(ip), frameBase(fb), slotCount(slots) {}
+};
+constexpr size_t FRAMES_MAX = 1 << 16;
+
+// Operand stack: one fixed-capacity mapping with a PROT_NONE guard page on each side, so running off either end
+// faults instead of corrupting memory, and pushes need no capacity check. Pages are only committed once touched.
+constexpr size_t STACK_SLOTS = 1 << 20;
+
+struct ValueStack {
+    Value* base;
+    Value* top; // one past the last pushed value
+    Value* limit;
+    size_t pageSize, mappedBytes;
+    char* mapping;
+
+    ValueStack(){
+        pageSize = sysconf(_SC_PAGESIZE);
+        size_t bytes = (STACK_SLOTS * sizeof(Value) + pageSize - 1) / pageSize * pageSize;
+        mappedBytes = bytes + 2 * pageSize;
+        void* m = mmap(nullptr, mappedBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m == MAP_FAILED) { perror("mmap operand stack"); exit(1); }
+        mapping = (char*)m;
+        if (mprotect(mapping + pageSize, bytes, PROT_READ | PROT_WRITE) != 0) { perror("mprotect operand stack"); exit(1); }
+        base = top = (Value*)(mapping + pageSize);
+        limit = base + bytes / sizeof(Value);
+    }
+    ~ValueStack(){ munmap(mapping, mappedBytes); }
+    ValueStack(const ValueStack&) = delete;
+    ValueStack& operator=(const ValueStack&) = delete;
+
+    bool inGuardPage(const void* addr) const {
+        const char* a = (const char*)addr;
+        return (a >= mapping && a < mapping + pageSize) || (a >= (const char*)limit && a < mapping + mappedBytes);
+    }
+
+    // vector-style helpers for code outside the dispatch loop.
+    size_t size() const { return top - base; }
+    bool empty() const { return top == base; }
+    void push_back(const Value& v){ *top++ = v; }
+    void pop_back(){ top--; }
+    Value& back(){ return top[-1]; }
+    Value& operator[](size_t i){ return base[i]; }
+    const Value& operator[](size_t i) const { return base[i]; }
+    const Value* begin() const { return base; }
+    const Value* end() const { return top; }
+};
+
+// Read-only views of the code and line table being run. They point either at the front end's vectors or straight
+// into a mapped .vmb file, so loading a precompiled program copies nothing.
+struct CodeView {
+    const int* words = nullptr;
+    int len = 0;
+
+    CodeView() {}
+    CodeView(const vector<int>& v) : words(v.data()), len(v.size()) {}
+    CodeView(const int* w, int n) : words(w), len(n) {}
+    int size() const { return len; }
+    int operator[](int i) const { return words[i]; }
+};
+struct LineTable {
+    const LineEntry* entries = nullptr;
+    int count = 0;
+
+    LineTable() {}
+    LineTable(const vector<LineEntry>& v) : entries(v.data()), count(v.size()) {}
+    LineTable(const LineEntry* e, int n) : entries(e), count(n) {}
+    int lineAt(int offset) const { // 0 if unknown
+        const LineEntry* e = upper_bound(entries, entries + count, offset,
+            [](int off, const LineEntry& x){ return off < x.offset; });
+        return e == entries ? 0 : e[-1].line;
+    }
+};
+
+struct VM {
+    int ip;
+    ValueStack opst; // operand stack
+    vector<callFrame> callst; //call stack
+
+    CodeView bc; //bytecode
+    vector<string> constants; // constant pool
+    vector<int> constantObjects; // the permanent string made for each constant
+    LineTable lines;
+
+    Heap heap;
+    VM(){ 
+        ip = 0;
+        callst.reserve(FRAMES_MAX); // CALL never reallocates
+    }
+
+    // push a frame whose locals start at the current top of the operand stack. Slots start out nil.
+    void enterFrame(int returnIP, int slotCount){
+        callst.push_back(callFrame(returnIP, opst.size(), slotCount));
+        for (int i = 0; i < slotCount; i++) opst.push_back(Value::Nil());
+    }
+};
+
+// Turns a fault in one of the operand stack's guard pages into a clean error exit.
+const ValueStack* guardedStack = nullptr;
+void onStackFault(int sig, siginfo_t* info, void*){
+    if (guardedStack && guardedStack->inGuardPage(info->si_addr)){
+        const char msg[] = "Operand stack overflow\n";
+        if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {}
+        _exit(1);
+    }
+    signal(sig, SIG_DFL); // not ours: let it crash normally
+    raise(sig);
+}
+void installStackGuard(const ValueStack& st){
+    guardedStack = &st;
+    struct sigaction sa = {};
+    sa.sa_sigaction = onStackFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, nullptr);
+    sigaction(SIGBUS, &sa, nullptr);
+}
+
+// One step of an old-generation collection: blacken a grey array or map by greying what it refers to.
+void scanObject(int ob, VM &vm){
+    ObjHeader& arr = *vm.heap.old[ob];
+    for (Value* v = arr.refs(), *end = v + arr.refCount(); v < end; v++) vm.heap.shade(*v);
+}
+void markRoots(VM &vm){
+    for (const auto& val : vm.opst) { // locals of every frame live on the operand stack too
+        vm.heap.shade(val);
+    }
+}
+// Runs right after a minor collection, so at the start nothing refers to the nursery.
+void startCollection(VM &vm){
+    vm.heap.phase = GcPhase::MARKING;
+    markRoots(vm);
+}
+// Stop-the-world marking on several threads. Each worker drains a private stack; while it holds plenty and its
+// shared stack is empty it moves a batch over, and a worker that runs dry takes its own shared stack back or
+// steals half of someone else's. A worker that finds nothing anywhere counts itself idle and waits for work to
+// show up; marking is over once every worker is idle, since only a busy worker can publish more.
+constexpr size_t STEAL_BATCH = 64;
+constexpr size_t PARALLEL_MARK_MIN = 1 << 16; // smaller old generations are marked on the calling thread
+
+struct MarkWorker {
+    mutex lock;
+    vector<int> shared;           // guarded by lock
+    atomic<size_t> sharedSize{0}; // peeked at without it
+};
+
+void markParallel(VM &vm, int threads){
+    Heap& heap = vm.heap;
+    unique_ptr<MarkWorker[]> workers(new MarkWorker[threads]);
+    for (size_t i = 0; i < heap.grey.size(); i++) workers[i % threads].shared.push_back(heap.grey[i]);
+    for (int i = 0; i < threads; i++) workers[i].sharedSize = workers[i].shared.size();
+    heap.grey.clear();
+    atomic<int> idle(0);
+
+    auto take = [&](MarkWorker& w, vector<int>& local, bool half){
+        if (w.sharedSize.load(memory_order_relaxed) == 0) return false;
+        lock_guard<mutex> guard(w.lock);
+        size_t n = w.shared.size(), count = half ? (n + 1) / 2 : n;
+        if (n == 0) return false;
+        local.insert(local.end(), w.shared.end() - count, w.shared.end());
+        w.shared.resize(n - count);
+        w.sharedSize.store(n - count, memory_order_relaxed);
+        return true;
+    };
+    auto findWork = [&](int id, vector<int>& local){
+        if (take(workers[id], local, false)) return true;
+        for (int k = 1; k < threads; k++) if (take(workers[(id + k) % threads], local, true)) return true;
+        return false;
+    };
+    auto worker = [&](int id){
+        MarkWorker& me = workers[id];
+        vector<int> local;
+        while (true){
+            while (!local.empty()){
+                int ob = local.back();
+                local.pop_back();
+                ObjHeader& arr = *heap.old[ob];
+                for (Value* e = arr.refs(), *end = e + arr.refCount(); e < end; e++){
+                    const Value& v = *e;
+                    if (!v.isObject() || Heap::young(v.asHandle()) || !heap.marks.set(v.asHandle())) continue;
+                    if (heap.old[v.asHandle()]->scanned()) local.push_back(v.asHandle());
+                }
+                if (local.size() > 2 * STEAL_BATCH && me.sharedSize.load(memory_order_relaxed) == 0){
+                    lock_guard<mutex> guard(me.lock);
+                    me.shared.insert(me.shared.end(), local.end() - STEAL_BATCH, local.end());
+                    local.resize(local.size() - STEAL_BATCH);
+                    me.sharedSize.store(me.shared.size(), memory_order_relaxed);
+                }
+            }
+            if (findWork(id, local)) continue;
+            idle++;
+            while (local.empty()){
+                if (idle.load() == threads) return;
+                bool seen = false;
+                for (int k = 0; k < threads && !seen; k++) seen = workers[k].sharedSize.load(memory_order_relaxed) > 0;
+                if (!seen) { this_thread::yield(); continue; }
+                idle--;
+                if (!findWork(id, local)) idle++;
+            }
+        }
+    };
+    vector<thread> helpers;
+    for (int id = 1; id < threads; id++) helpers.emplace_back(worker, id);
+    worker(0);
+    for (auto& t : helpers) t.join();
+}
+
+// Advance the old-generation cycle by at least `minWork` objects and then until `deadline`; returns true once the
+// cycle is over. The clock is read every SLICE_CHECK objects.
+constexpr int SLICE_CHECK = 64;
+bool collectSlice(VM &vm, long long minWork, chrono::steady_clock::time_point deadline){
+    Heap& heap = vm.heap;
+    if (heap.phase == GcPhase::MARKING && deadline == chrono::steady_clock::time_point::max()){
+        auto start = chrono::steady_clock::now();
+        if (heap.markThreads > 1 && heap.old.size() >= PARALLEL_MARK_MIN) markParallel(vm, heap.markThreads);
+        else while (!heap.grey.empty()){
+            int ob = heap.grey.back();
+            heap.grey.pop_back();
+            scanObject(ob, vm);
+        }
+        heap.stats.markMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+    for (int n = 1; heap.phase == GcPhase::MARKING; n++){
+        if (heap.grey.empty()){
+            heap.phase = GcPhase::SWEEPING;
+            heap.sweepCursor = heap.permanent;
+            heap.sweptLive = 0;
+            break;
+        }
+        int ob = heap.grey.back();
+        heap.grey.pop_back();
+        scanObject(ob, vm);
+        if (n >= minWork && n % SLICE_CHECK == 0 && chrono::steady_clock::now() >= deadline) return false;
+    }
+    for (int n = 1; heap.sweepCursor < heap.old.size(); n++){
+        if (!heap.old[heap.sweepCursor]) {}
+        else if (!heap.marks.test(heap.sweepCursor)) heap.release(heap.sweepCursor);
+        else { heap.marks.clear(heap.sweepCursor); heap.sweptLive++; }
+        heap.sweepCursor++;
+        if (n >= minWork && n % SLICE_CHECK == 0 && chrono::steady_clock::now() >= deadline) return false;
+    }
+    heap.phase = GcPhase::IDLE;
+    heap.liveAfterFull = heap.sweptLive;
+    heap.liveBytesAfterFull = heap.stats.liveBytes = heap.oldBytes();
+    heap.setNextFull();
+    heap.stats.major++;
+    return true;
+}
+
+// Minor collection. Promoting an object copies it to the old generation and leaves its new handle behind in the
+// nursery slot; promoted arrays are then scanned in turn, so everything reachable from the roots and the
+// remembered set is moved and every reference to it rewritten.
+int promote(VM &vm, int h, vector<int>& scan){
+    Heap& heap = vm.heap;
+    int slot = h - NURSERY_BASE;
+    if (heap.forward[slot] != -1) return heap.forward[slot];
+    ObjHeader* young = heap.nursery[slot];
+    int to;
+    if (young->sizeClass == LARGE_CLASS) to = heap.adopt(young); // promoted in place
+    else {
+        to = heap.allocateOld(young->type, young->size);
+        memcpy(heap.old[to]->chars(), young->chars(), young->bytes() - sizeof(ObjHeader));
+    }
+    heap.forward[slot] = to; // a map's table goes with its MapData
+    if (young->scanned()) scan.push_back(to);
+    heap.stats.promoted++;
+    return to;
+}
+void promoteElements(VM &vm, int h, vector<int>& scan){
+    ObjHeader& arr = *vm.heap.old[h]; // cells never move, so promoting into the old generation leaves `arr` put
+    for (Value* v = arr.refs(), *end = v + arr.refCount(); v < end; v++){
+        if (v->isObject() && Heap::young(v->asHandle())) *v = Value::Object(promote(vm, v->asHandle(), scan));
+    }
+}
+void collectNursery(VM &vm){
+    vector<int> scan;
+    for (Value* v = vm.opst.base; v < vm.opst.top; v++){
+        if (v->isObject() && Heap::young(v->asHandle())) *v = Value::Object(promote(vm, v->asHandle(), scan));
+    }
+    for (int h : vm.heap.remembered){
+        vm.heap.old[h]->remembered = false;
+        promoteElements(vm, h, scan);
+    }
+    vm.heap.remembered.clear();
+    while (!scan.empty()){
+        int h = scan.back();
+        scan.pop_back();
+        promoteElements(vm, h, scan);
+    }
+    for (int slot : vm.heap.youngMaps) if (vm.heap.forward[slot] == -1) vm.heap.freeMapTable(*vm.heap.nursery[slot]);
+    vm.heap.youngMaps.clear();
+    for (int slot : vm.heap.largeYoung) if (vm.heap.forward[slot] == -1) free(vm.heap.nursery[slot]);
+    vm.heap.largeYoung.clear();
+    vm.heap.top = 0;
+    vm.heap.nurseryUsed = 0;
+    vm.heap.stats.minor++;
+}
+
+// Copying compaction, run after a full collection once the old generation is mostly holes. Live objects get
+// handles 0..n-1 in their current order and are copied into fresh slabs in that order; the old slabs are unmapped
+// and every handle in the operand stack (locals included) and in arrays is rewritten. The nursery is empty, so
+// nothing else holds a handle. Order is kept, so objects allocated together stay together. It is a single pause
+// even under a pause target, but it only runs once most of the heap has died, so there is little left to copy.
+void compactHeap(VM &vm){
+    Heap& heap = vm.heap;
+    vector<char*> slabs;
+    slabs.swap(heap.slabs);
+    for (auto& sc : heap.classes) sc = Heap::SizeClass();
+    heap.cellBytes = 0;
+
+    vector<int> moved(heap.old.size(), -1);
+    deque<ObjHeader*> packed;
+    for (size_t h = 0; h < heap.old.size(); h++){
+        ObjHeader* ob = heap.old[h];
+        if (!ob) continue;
+        if (ob->sizeClass < CLASS_COUNT){ // slab cells; the rest stay where they are
+            ObjHeader* to = (ObjHeader*)heap.allocateCell(ob->sizeClass);
+            memcpy(to, ob, ob->bytes());
+            ob = to;
+        }
+        moved[h] = packed.size();
+        packed.push_back(ob);
+    }
+    for (char* slab : slabs) munmap(slab, SLAB_BYTES);
+    auto rewrite = [&](Value& v){ if (v.isObject()) v = Value::Object(moved[v.asHandle()]); };
+    for (Value* v = vm.opst.base; v < vm.opst.top; v++) rewrite(*v);
+    for (ObjHeader* ob : packed){ // map keys are permanent strings at most, so no map needs rehashing
+        if (!ob->scanned()) continue;
+        for (Value* v = ob->refs(), *end = v + ob->refCount(); v < end; v++) rewrite(*v);
+    }
+    heap.old = move(packed); // frees the old table before the trim below
+    heap.freeOld = queue<int>();
+    heap.marks = MarkBitmap(); // all clear after the sweep; this just gives back the bitmap's tail
+    heap.marks.ensure(heap.old.size());
+    heap.markPermanent(); // they come first and never move, so their handles are unchanged
+    vector<int>().swap(heap.grey); // sized for the spike's marking
+#ifdef __GLIBC__
+    malloc_trim(0); // large objects freed by the sweep
+#endif
+    heap.stats.compactions++;
+}
+
+// Allocation found the nursery full. The caller has synced the operand stack. Without a pause target a due
+// old-generation collection runs to the end here; with one, a slice of it gets whatever the minor collection left
+// of the target, but always covers SLICE_PACE objects per promotion so the cycle outruns the program. A cycle
+// that falls behind anyway, or one that has to get the heap back under its hard limit, is finished in one go.
+// `bytes` is the allocation waiting for the collection, `tenured` if it goes to the old generation.
+constexpr int SLICE_PACE = 4;
+void collect(VM &vm, size_t bytes, bool tenured = false){
+    Heap& heap = vm.heap;
+    auto start = chrono::steady_clock::now();
+    long long promoted = heap.stats.promoted;
+    size_t incoming = tenured || bytes > PRETENURE_BYTES ? bytes : 0; // goes straight to the old generation
+    collectNursery(vm);
+    heap.stats.peakBytes = max(heap.stats.peakBytes, heap.oldBytes() + incoming);
+    if (heap.phase == GcPhase::IDLE && (heap.oldFull() || heap.overLimit(incoming))) startCollection(vm);
+    if (heap.phase != GcPhase::IDLE){
+        auto deadline = heap.pauseTargetUs <= 0 || heap.behind() || heap.overLimit(incoming) ? chrono::steady_clock::time_point::max()
+                      : start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, micro>(heap.pauseTargetUs));
+        bool done = collectSlice(vm, SLICE_PACE * (heap.stats.promoted - promoted), deadline);
+        if (done && heap.fragmented()) compactHeap(vm);
+    }
+    if (heap.overLimit(incoming)){ // the cycle that just ended may have started before its garbage was made
+        startCollection(vm);
+        collectSlice(vm, 0, chrono::steady_clock::time_point::max());
+        if (heap.overLimit(incoming)) {
+            cerr << "Heap limit exceeded: " << (heap.oldBytes() + incoming) / (1 << 20) << " MB live, limit "
+                 << heap.hardLimit / (1 << 20) << " MB\n";
+            exit(1);
+        }
+        if (heap.fragmented()) compactHeap(vm);
+    }
+    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    heap.stats.ms += us / 1000;
+    heap.stats.pauses.push_back(us);
+}
+
+// Number of operand words that follow each opcode in the bytecode stream.
+int operandCount(Opcode op){
+    switch (op){
+        case Opcode::FOR_RANGE:
+        case Opcode::FOR_RANGE_L:
+            return 3;
+        case Opcode::CALL: // target, callee slot count
+        case Opcode::ADD_LL:
+        case Opcode::ALLOC_PACKED:
+            return 2;
+        case Opcode::ADD_K:
+        case Opcode::SET_LOCAL_POP:
+        case Opcode::JUMP_IF_NOT_LT:
+        case Opcode::JUMP_IF_NOT_LE:
+        case Opcode::JUMP_IF_NOT_GT:
+        case Opcode::JUMP_IF_NOT_GE:
+        case Opcode::JUMP_IF_NOT_EQ:
+        case Opcode::JUMP_IF_NOT_NE:
+        case Opcode::PUSH:
+        case Opcode::ALLOC_STRING:
+        case Opcode::ALLOC_ARRAY:
+        case Opcode::GET_LOCAL:
+        case Opcode::SET_LOCAL:
+        case Opcode::GET_GLOBAL:
+        case Opcode::SET_GLOBAL:
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP:
+        case Opcode::JUMP_IF_TRUE:
+        case Opcode::ARRAY_MAP:
+        case Opcode::ALLOC_MAP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+const char* opcodeName(Opcode op){
+    switch (op){
+        case Opcode::PUSH: return "PUSH";
+        case Opcode::POP: return "POP";
+        case Opcode::NEG: return "NEG";
+        case Opcode::NOT: return "NOT";
+        case Opcode::ADD: return "ADD";
+        case Opcode::SUB: return "SUB";
+        case Opcode::MUL: return "MUL";
+        case Opcode::DIV: return "DIV";
+        case Opcode::MOD: return "MOD";
+        case Opcode::CALL: return "CALL";
+        case Opcode::RET: return "RET";
+        case Opcode::ALLOC_STRING: return "ALLOC_STRING";
+        case Opcode::ALLOC_ARRAY: return "ALLOC_ARRAY";
+        case Opcode::GET_INDEX: return "GET_INDEX";
+        case Opcode::SET_INDEX: return "SET_INDEX";
+        case Opcode::GET_LOCAL: return "GET_LOCAL";
+        case Opcode::SET_LOCAL: return "SET_LOCAL";
+        case Opcode::GET_GLOBAL: return "GET_GLOBAL";
+        case Opcode::SET_GLOBAL: return "SET_GLOBAL";
+        case Opcode::LESSTHAN: return "LESSTHAN";
+        case Opcode::LESSEQUAL: return "LESSEQUAL";
+        case Opcode::GRTRTHAN: return "GRTRTHAN";
+        case Opcode::GRTREQUAL: return "GRTREQUAL";
+        case Opcode::EQUAL: return "EQUAL";
+        case Opcode::NOTEQUAL: return "NOTEQUAL";
+        case Opcode::PRINT: return "PRINT";
+        case Opcode::JUMP_IF_FALSE: return "JUMP_IF_FALSE";
+        case Opcode::JUMP: return "JUMP";
+        case Opcode::JUMP_IF_TRUE: return "JUMP_IF_TRUE";
+        case Opcode::PUSH_TRUE: return "PUSH_TRUE";
+        case Opcode::PUSH_FALSE: return "PUSH_FALSE";
+        case Opcode::ADD_LL: return "ADD_LL";
+        case Opcode::ADD_K: return "ADD_K";
+        case Opcode::SET_LOCAL_POP: return "SET_LOCAL_POP";
+        case Opcode::JUMP_IF_NOT_LT: return "JUMP_IF_NOT_LT";
+        case Opcode::JUMP_IF_NOT_LE: return "JUMP_IF_NOT_LE";
+        case Opcode::JUMP_IF_NOT_GT: return "JUMP_IF_NOT_GT";
+        case Opcode::JUMP_IF_NOT_GE: return "JUMP_IF_NOT_GE";
+        case Opcode::JUMP_IF_NOT_EQ: return "JUMP_IF_NOT_EQ";
+        case Opcode::JUMP_IF_NOT_NE: return "JUMP_IF_NOT_NE";
+        case Opcode::FOR_RANGE: return "FOR_RANGE";
+        case Opcode::FOR_RANGE_L: return "FOR_RANGE_L";
+        case Opcode::ALLOC_PACKED: return "ALLOC_PACKED";
+        case Opcode::ARRAY_FILL: return "ARRAY_FILL";
+        case Opcode::ARRAY_COPY: return "ARRAY_COPY";
+        case Opcode::ARRAY_SUM: return "ARRAY_SUM";
+        case Opcode::ARRAY_MIN: return "ARRAY_MIN";
+        case Opcode::ARRAY_MAX: return "ARRAY_MAX";
+        case Opcode::ARRAY_EQUAL: return "ARRAY_EQUAL";
+        case Opcode::ARRAY_MAP: return "ARRAY_MAP";
+        case Opcode::ALLOC_MAP: return "ALLOC_MAP";
+        case Opcode::MAP_GET: return "MAP_GET";
+        case Opcode::MAP_SET: return "MAP_SET";
+        case Opcode::MAP_DEL: return "MAP_DEL";
+        case Opcode::HALT: return "HALT";
+    }
+    return "???";
+}
+
+// Tracing policies. run() is instantiated once per policy, so the normal build carries no tracing code at all
+// and only PRINT writes to stdout.
+struct NoTrace {
+    static constexpr bool enabled = false;
+    void record(const VM&){}
+    void recordRegister(const VM&, int, int){}
+};
+
+struct CountTrace { // counts dispatched instructions, for --bench
+    static constexpr bool enabled = true;
+    long long executed = 0;
+    void record(const VM&){ executed++; }
+    void recordRegister(const VM&, int, int){ executed++; }
+};
+
+struct FileTrace { // one buffered line per executed instruction: ip, opcode, stack depth, top of stack
+    static constexpr bool enabled = true;
+    ofstream out;
+    char buffer[1 << 16];
+
+    FileTrace(const string& path){
+        out.rdbuf()->pubsetbuf(buffer, sizeof(buffer)); // must happen before open() to take effect
+        out.open(path);
+    }
+    void writeValue(const Value& v){
+        switch (v.type()){
+            case ValueType::INT: out << v.asInt(); break;
+            case ValueType::BOOL: out << (v.asBool() ? "true" : "false"); break;
+            case ValueType::NIL: out << "nil"; break;
+            case ValueType::OBJECT: out << "obj#" << v.asHandle(); break;
+        }
+    }
+    void record(const VM &vm){
+        int depth = vm.opst.size();
+        out << "ip=" << vm.ip << " op=";
+        if (vm.ip >= 0 && vm.ip < (int)vm.bc.size() && vm.bc[vm.ip] >= 0 && vm.bc[vm.ip] < OPCODE_COUNT)
+            out << opcodeName((Opcode) vm.bc[vm.ip]);
+        else out << "???";
+        if (vm.lines.count) out << " line=" << vm.lines.lineAt(vm.ip);
+        out << " depth=" << depth << " top=[";
+        for (int i = depth - 1; i >= 0 && i >= depth - 3; i--){
+            writeValue(vm.opst[i]);
+            if (i > 0 && i > depth - 3) out << ", ";
+        }
+        out << "]\n";
+    }
+    void recordRegister(const VM&, int pc, int op); // defined with the register tier below
+};
+
+// Bytecode rewriting. Passes that change instruction lengths work on a decoded list in which jump operands are
+// instruction indices rather than bytecode offsets; encode() turns them back into offsets afterwards.
+struct Instr {
+    Opcode op;
+    int a = 0, b = 0, c = 0; // operands, in bytecode order
+    bool target = false;      // some jump lands here
+    int line = 0;             // source line, 0 if unknown
+};
+
+int jumpOperand(Opcode op){ // which operand (0-2) is a jump target, or -1
+    switch (op){
+        case Opcode::JUMP:
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP_IF_TRUE:
+        case Opcode::CALL:
+        case Opcode::JUMP_IF_NOT_LT:
+        case Opcode::JUMP_IF_NOT_LE:
+        case Opcode::JUMP_IF_NOT_GT:
+        case Opcode::JUMP_IF_NOT_GE:
+        case Opcode::JUMP_IF_NOT_EQ:
+        case Opcode::JUMP_IF_NOT_NE:
+            return 0;
+        case Opcode::FOR_RANGE:
+        case Opcode::FOR_RANGE_L:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+int& operand(Instr& in, int k){ return k == 0 ? in.a : k == 1 ? in.b : in.c; }
+
+vector<Instr> decode(const vector<int>& bc, const vector<LineEntry>& lines = {}){
+    vector<Instr> out;
+    vector<int> indexAt(bc.size() + 1, -1);
+    size_t nextLine = 0;
+    int line = 0;
+    for (size_t i = 0; i < bc.size(); i += 1 + operandCount((Opcode) bc[i])){
+        while (nextLine < lines.size() && lines[nextLine].offset <= (int)i) line = lines[nextLine++].line;
+        Instr in;
+        in.line = line;
+        in.op = (Opcode) bc[i];
+        for (int k = 0; k < operandCount(in.op); k++) operand(in, k) = bc[i + 1 + k];
+        indexAt[i] = out.size();
+        out.push_back(in);
+    }
+    indexAt[bc.size()] = out.size();
+    for (auto& in : out){
+        int k = jumpOperand(in.op);
+        if (k < 0) continue;
+        int& t = operand(in, k);
+        assert(t >= 0 && t <= (int)bc.size() && indexAt[t] != -1); // jumps must land on an instruction
+        t = indexAt[t];
+    }
+    for (auto& in : out){
+        int k = jumpOperand(in.op);
+        if (k >= 0 && operand(in, k) < (int)out.size()) out[operand(in, k)].target = true;
+    }
+    return out;
+}
+
+// Also rebuilds the line table when asked for one.
+vector<int> encode(const vector<Instr>& code, vector<LineEntry>* lines = nullptr){
+    vector<int> offsetOf(code.size() + 1);
+    int offset = 0;
+    for (size_t i = 0; i < code.size(); i++){
+        offsetOf[i] = offset;
+        offset += 1 + operandCount(code[i].op);
+    }
+    offsetOf[code.size()] = offset;
+    vector<int> bc;
+    bc.reserve(offset);
+    if (lines) lines->clear();
+    for (auto in : code){
+        if (lines && (lines->empty() || lines->back().line != in.line)) lines->push_back({(int)bc.size(), in.line});
+        int k = jumpOperand(in.op);
+        if (k >= 0) operand(in, k) = offsetOf[operand(in, k)];
+        bc.push_back((int)in.op);
+        for (int j = 0; j < operandCount(in.op); j++) bc.push_back(operand(in, j));
+    }
+    return bc;
+}
+
+// Rebuilds a list after a pass that replaced runs of instructions: newIndex[i] is where old instruction i ended up
+// (a fused run maps to its single replacement), so every jump operand can be relocated.
+void relocateJumps(vector<Instr>& code, const vector<int>& newIndex){
+    for (auto& in : code){
+        int k = jumpOperand(in.op);
+        if (k >= 0) operand(in, k) = newIndex[operand(in, k)];
+    }
+    for (auto& in : code) in.target = false;
+    for (auto& in : code){
+        int k = jumpOperand(in.op);
+        if (k >= 0 && operand(in, k) < (int)code.size()) code[operand(in, k)].target = true;
+    }
+}
+
+// Bytecode optimizer (-O1 and up), run to a fixed point over the decoded list. The stats count removed
+// instructions, except `threaded` (retargeted jumps) and `folded` (tree nodes simplified by the Folder before
+// compiling).
+//  - peephole: "SET_LOCAL n; POP; GET_LOCAL n" -> "SET_LOCAL n", "NOT; JUMP_IF_FALSE" -> "JUMP_IF_TRUE",
+//    a push immediately popped disappears, a conditional jump on a pushed true/false becomes a JUMP or nothing,
+//    a conditional jump to the next instruction becomes POP
+//  - jump threading: jumps to a JUMP go straight to its final target, a JUMP to the next instruction is dropped
+//  - dead code: instructions unreachable from the entry point
+//  - dead stores (-O2): SET_LOCAL to a slot nothing ever reads (skipped for programs with CALL, whose frames reuse
+//    slot numbers)
+// -O2 also fuses superinstructions, see below.
+struct OptStats {
+    int before = 0, after = 0;
+    int peephole = 0, threaded = 0, deadCode = 0, deadStores = 0, fused = 0, folded = 0;
+};
+
+bool isJump(Opcode op){ return jumpOperand(op) >= 0 && op != Opcode::CALL; }
+
+// Drops every instruction with keep[i] == false. A jump to a dropped instruction moves to the next kept one,
+// which is what every caller wants: dropped instructions are either no-ops or have their effect merged forward.
+void compact(vector<Instr>& code, const vector<bool>& keep){
+    vector<int> newIndex(code.size() + 1);
+    vector<Instr> out;
+    int kept = 0;
+    for (size_t i = 0; i < code.size(); i++){
+        newIndex[i] = kept;
+        if (keep[i]) { out.push_back(code[i]); kept++; }
+    }
+    newIndex[code.size()] = kept;
+    relocateJumps(out, newIndex);
+    code = out;
+}
+
+bool peephole(vector<Instr>& code, OptStats& st){
+    vector<bool> keep(code.size(), true);
+    int removed = 0;
+    for (size_t i = 0; i < code.size(); i++){
+        if (!keep[i]) continue;
+        auto next = [&](size_t k, Opcode op){ return i + k < code.size() && keep[i + k] && !code[i + k].target && code[i + k].op == op; };
+
+        if (code[i].op == Opcode::SET_LOCAL && next(1, Opcode::POP) && next(2, Opcode::GET_LOCAL) && code[i + 2].a == code[i].a){
+            keep[i + 1] = keep[i + 2] = false; // the value is still on the stack
+            removed += 2;
+        }
+        else if (code[i].op == Opcode::NOT && (next(1, Opcode::JUMP_IF_FALSE) || next(1, Opcode::JUMP_IF_TRUE))){
+            code[i + 1].op = code[i + 1].op == Opcode::JUMP_IF_FALSE ? Opcode::JUMP_IF_TRUE : Opcode::JUMP_IF_FALSE;
+            keep[i] = false;
+            removed++;
+        }
+        else if ((code[i].op == Opcode::PUSH_TRUE || code[i].op == Opcode::PUSH_FALSE)
+                 && (next(1, Opcode::JUMP_IF_FALSE) || next(1, Opcode::JUMP_IF_TRUE))){
+            bool taken = (code[i].op == Opcode::PUSH_TRUE) == (code[i + 1].op == Opcode::JUMP_IF_TRUE);
+            keep[i] = false; // the branch direction is known
+            if (taken) code[i + 1].op = Opcode::JUMP;
+            else keep[i + 1] = false;
+            removed += taken ? 1 : 2;
+        }
+        else if ((code[i].op == Opcode::PUSH || code[i].op == Opcode::PUSH_TRUE || code[i].op == Opcode::PUSH_FALSE
+                  || code[i].op == Opcode::GET_LOCAL || code[i].op == Opcode::ALLOC_STRING) && next(1, Opcode::POP)){
+            keep[i] = keep[i + 1] = false;
+            removed += 2;
+        }
+        else if ((code[i].op == Opcode::JUMP_IF_FALSE || code[i].op == Opcode::JUMP_IF_TRUE) && code[i].a == (int)i + 1){
+            code[i].op = Opcode::POP; // both ways lead to the next instruction, just drop the condition
+            code[i].a = 0;
+        }
+    }
+    st.peephole += removed;
+    if (removed) compact(code, keep);
+    return removed > 0;
+}
+
+bool threadJumps(vector<Instr>& code, OptStats& st){
+    bool changed = false;
+    vector<bool> keep(code.size(), true);
+    for (size_t i = 0; i < code.size(); i++){
+        if (!isJump(code[i].op)) continue;
+        int& t = operand(code[i], jumpOperand(code[i].op));
+        int hops = 0;
+        while (t < (int)code.size() && code[t].op == Opcode::JUMP && code[t].a != t && hops++ < (int)code.size()){
+            t = code[t].a;
+            st.threaded++;
+            changed = true;
+        }
+        if (code[i].op == Opcode::JUMP && t == (int)i + 1){
+            keep[i] = false;
+            st.peephole++;
+            changed = true;
+        }
+    }
+    compact(code, keep);
+    return changed;
+}
+
+bool removeDeadCode(vector<Instr>& code, OptStats& st){
+    vector<bool> reached(code.size(), false);
+    vector<int> work = {0};
+    while (!work.empty()){
+        int i = work.back(); work.pop_back();
+        if (i >= (int)code.size() || reached[i]) continue;
+        reached[i] = true;
+        Opcode op = code[i].op;
+        if (jumpOperand(op) >= 0) work.push_back(operand(code[i], jumpOperand(op)));
+        if (op != Opcode::JUMP && op != Opcode::HALT && op != Opcode::RET) work.push_back(i + 1);
+    }
+    int dead = count(reached.begin(), reached.end(), false);
+    if (code.empty() || dead == 0) return false;
+    st.deadCode += dead;
+    compact(code, reached);
+    return true;
+}
+
+bool removeDeadStores(vector<Instr>& code, OptStats& st){
+    unordered_map<int, bool> read;
+    for (auto& in : code){
+        switch (in.op){
+            case Opcode::CALL: case Opcode::RET: return false;
+            case Opcode::GET_LOCAL: case Opcode::FOR_RANGE: read[in.a] = true; break;
+            case Opcode::ADD_LL: case Opcode::FOR_RANGE_L: read[in.a] = read[in.b] = true; break;
+            default: break;
+        }
+    }
+    vector<bool> keep(code.size(), true);
+    int removed = 0;
+    for (size_t i = 0; i < code.size(); i++){
+        if (code[i].op == Opcode::SET_LOCAL && !read.count(code[i].a)) { keep[i] = false; removed++; } // SET_LOCAL leaves the value on the stack either way
+    }
+    st.deadStores += removed;
+    if (removed) compact(code, keep);
+    return removed > 0;
+}
+
+OptStats optimize(vector<Instr>& code, int level){
+    OptStats st;
+    st.before = code.size();
+    if (level >= 1){
+        bool changed = true;
+        for (int round = 0; changed && round < 16; round++){
+            changed = false;
+            changed |= removeDeadCode(code, st);
+            changed |= threadJumps(code, st);
+            changed |= peephole(code, st);
+            if (level >= 2) changed |= removeDeadStores(code, st);
+        }
+    }
+    st.after = code.size();
+    return st;
+}
+
+// Superinstructions. Each rule fuses a fixed sequence the compiler emits all the time into one dispatch. Which
+// rules run, and in what priority, comes from opcode-pair frequencies over the program itself: pairs inside
+// loops are weighted by 8^depth, and a rule whose leading pair is below MIN_PAIR_SHARE of the weighted total is
+// not worth an extra opcode in the hot path.
+enum class Fusion { FOR_RANGE, ADD_LL, ADD_K, SET_LOCAL_POP, COMPARE_JUMP };
+constexpr double MIN_PAIR_SHARE = 0.01;
+
+bool isCompare(Opcode op){
+    return op == Opcode::LESSTHAN || op == Opcode::LESSEQUAL || op == Opcode::GRTRTHAN
+        || op == Opcode::GRTREQUAL || op == Opcode::EQUAL || op == Opcode::NOTEQUAL;
+}
+
+Opcode compareJump(Opcode cmp){
+    switch (cmp){
+        case Opcode::LESSTHAN: return Opcode::JUMP_IF_NOT_LT;
+        case Opcode::LESSEQUAL: return Opcode::JUMP_IF_NOT_LE;
+        case Opcode::GRTRTHAN: return Opcode::JUMP_IF_NOT_GT;
+        case Opcode::GRTREQUAL: return Opcode::JUMP_IF_NOT_GE;
+        case Opcode::EQUAL: return Opcode::JUMP_IF_NOT_EQ;
+        default: return Opcode::JUMP_IF_NOT_NE;
+    }
+}
+
+// weighted frequency of each adjacent (first, second) opcode pair that could be fused (second is not a label)
+vector<double> pairFrequencies(const vector<Instr>& code){
+    vector<double> freq(OPCODE_COUNT * OPCODE_COUNT, 0);
+    vector<int> depth(code.size() + 1, 0);
+    for (size_t j = 0; j < code.size(); j++){ // a backward jump from j to t is a loop over [t, j]
+        if (code[j].op == Opcode::JUMP && code[j].a <= (int)j){
+            for (size_t i = code[j].a; i <= j; i++) depth[i]++;
+        }
+    }
+    for (size_t i = 0; i + 1 < code.size(); i++){
+        if (code[i + 1].target) continue;
+        double w = 1;
+        for (int d = 0; d < depth[i] && d < 6; d++) w *= 8;
+        freq[(int)code[i].op * OPCODE_COUNT + (int)code[i + 1].op] += w;
+    }
+    return freq;
+}
+
+// Length of the run starting at i that `rule` fuses, 0 if it does not match. Only the first instruction of a run
+// may be a jump target.
+int matchFusion(const vector<Instr>& code, size_t i, Fusion rule){
+    auto at = [&](size_t k, Opcode op){ return i + k < code.size() && code[i + k].op == op && (k == 0 || !code[i + k].target); };
+    switch (rule){
+        case Fusion::ADD_LL:
+            return at(0, Opcode::GET_LOCAL) && at(1, Opcode::GET_LOCAL) && at(2, Opcode::ADD) ? 3 : 0;
+        case Fusion::ADD_K:
+            return at(0, Opcode::PUSH) && at(1, Opcode::ADD) ? 2 : 0;
+        case Fusion::SET_LOCAL_POP:
+            return at(0, Opcode::SET_LOCAL) && at(1, Opcode::POP) ? 2 : 0;
+        case Fusion::COMPARE_JUMP:
+            return i + 1 < code.size() && isCompare(code[i].op) && at(1, Opcode::JUMP_IF_FALSE) ? 2 : 0;
+        case Fusion::FOR_RANGE: {
+            // back edge "GET_LOCAL i; PUSH 1; ADD; SET_LOCAL i; POP; JUMP head" of a loop whose head is
+            // "GET_LOCAL i; PUSH k | GET_LOCAL n; LESSTHAN; JUMP_IF_FALSE <just past the back edge>"
+            if (!(at(0, Opcode::GET_LOCAL) && at(1, Opcode::PUSH) && code[i + 1].a == 1 && at(2, Opcode::ADD)
+                && at(3, Opcode::SET_LOCAL) && at(4, Opcode::POP) && at(5, Opcode::JUMP))) return 0;
+            int slot = code[i].a, h = code[i + 5].a;
+            if (code[i + 3].a != slot || h + 3 >= (int)i) return 0;
+            const Instr *head = &code[h];
+            bool limitOk = head[1].op == Opcode::PUSH || (head[1].op == Opcode::GET_LOCAL && head[1].a != slot);
+            if (head[0].op != Opcode::GET_LOCAL || head[0].a != slot || !limitOk || head[2].op != Opcode::LESSTHAN
+                || head[3].op != Opcode::JUMP_IF_FALSE || head[3].a != (int)i + 6
+                || head[1].target || head[2].target || head[3].target) return 0;
+            return 6;
+        }
+    }
+    return 0;
+}
+
+Instr fused(const vector<Instr>& code, size_t i, Fusion rule){
+    Instr in;
+    in.target = code[i].target;
+    in.line = code[i].line;
+    switch (rule){
+        case Fusion::ADD_LL: in.op = Opcode::ADD_LL; in.a = code[i].a; in.b = code[i + 1].a; break;
+        case Fusion::ADD_K: in.op = Opcode::ADD_K; in.a = code[i].a; break;
+        case Fusion::SET_LOCAL_POP: in.op = Opcode::SET_LOCAL_POP; in.a = code[i].a; break;
+        case Fusion::COMPARE_JUMP: in.op = compareJump(code[i].op); in.a = code[i + 1].a; break;
+        case Fusion::FOR_RANGE: {
+            const Instr &limit = code[code[i + 5].a + 1];
+            in.op = limit.op == Opcode::PUSH ? Opcode::FOR_RANGE : Opcode::FOR_RANGE_L;
+            in.a = code[i].a;
+            in.b = limit.a;
+            in.c = code[i + 5].a + 4; // straight into the body, the head's test is done here
+            break;
+        }
+    }
+    return in;
+}
+
+// Returns how many instructions were removed.
+int fuseSuperinstructions(vector<Instr>& code){
+    vector<double> freq = pairFrequencies(code);
+    double total = 0;
+    for (double f : freq) total += f;
+    auto pairFreq = [&](Opcode a, Opcode b){ return freq[(int)a * OPCODE_COUNT + (int)b]; };
+
+    vector<pair<double, Fusion>> rules = {
+        {pairFreq(Opcode::ADD, Opcode::SET_LOCAL) + pairFreq(Opcode::SET_LOCAL, Opcode::POP) + pairFreq(Opcode::POP, Opcode::JUMP), Fusion::FOR_RANGE},
+        {pairFreq(Opcode::GET_LOCAL, Opcode::GET_LOCAL), Fusion::ADD_LL},
+        {pairFreq(Opcode::PUSH, Opcode::ADD), Fusion::ADD_K},
+        {pairFreq(Opcode::SET_LOCAL, Opcode::POP), Fusion::SET_LOCAL_POP},
+        {0, Fusion::COMPARE_JUMP},
+    };
+    for (int c = 0; c < OPCODE_COUNT; c++){
+        if (isCompare((Opcode)c)) rules[4].first += pairFreq((Opcode)c, Opcode::JUMP_IF_FALSE);
+    }
+    stable_sort(rules.begin(), rules.end(), [](const pair<double, Fusion>& x, const pair<double, Fusion>& y){ return x.first > y.first; });
+
+    vector<Instr> out;
+    vector<int> newIndex(code.size() + 1);
+    for (size_t i = 0; i < code.size();){
+        int len = 0;
+        Fusion chosen = Fusion::ADD_LL;
+        for (auto& rule : rules){
+            if (rule.first == 0 || rule.first < MIN_PAIR_SHARE * total) continue;
+            if ((len = matchFusion(code, i, rule.second))) { chosen = rule.second; break; }
+        }
+        if (len == 0){
+            newIndex[i] = out.size();
+            out.push_back(code[i++]);
+            continue;
+        }
+        for (int k = 0; k < len; k++) newIndex[i + k] = out.size();
+        out.push_back(fused(code, i, chosen));
+        i += len;
+    }
+    newIndex[code.size()] = out.size();
+    int removed = code.size() - out.size();
+    relocateJumps(out, newIndex);
+    code = out;
+    return removed;
+}
+
+// Dispatch engine. GCC/Clang builds use direct-threaded code: every opcode in vm.bc is translated into its handler's
+// address up front, and each handler jumps straight to the next one instead of going back through the loop head.
+// -DVM_SWITCH_DISPATCH (or a compiler without computed goto) falls back to the portable switch loop.
+// Both engines share the same handler bodies through the CASE/DISPATCH macros.
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+template <class Tracer>
+void run(VM &vm, Tracer &tracer){
+    // the stack pointer lives in a local so it can stay in a register; SYNC() writes it back before anything
+    // outside the loop (GC, tracer) looks at vm.opst.
+    Value* sp = vm.opst.top;
+    Value* fp = vm.opst.base + vm.callst.back().frameBase; // current frame's locals
+    #define SYNC() (vm.opst.top = sp)
+    #define DEPTH() (sp - vm.opst.base)
+
+#if VM_THREADED_DISPATCH
+    static const void* labels[] = { // indexed by Opcode, must stay in enum order
+        &&op_PUSH,
+        &&op_POP,
+        &&op_NEG,
+        &&op_NOT,
+        &&op_ADD,
+        &&op_SUB,
+        &&op_MUL,
+        &&op_DIV,
+        &&op_MOD,
+        &&op_CALL,
+        &&op_RET,
+        &&op_ALLOC_STRING,
+        &&op_ALLOC_ARRAY,
+        &&op_GET_INDEX,
+        &&op_SET_INDEX,
+        &&op_GET_LOCAL,
+        &&op_SET_LOCAL,
+        &&op_INVALID, // GET_GLOBAL (not implemented yet)
+        &&op_INVALID, // SET_GLOBAL
+        &&op_LESSTHAN,
+        &&op_LESSEQUAL,
+        &&op_GRTRTHAN,
+        &&op_GRTREQUAL,
+        &&op_EQUAL,
+        &&op_NOTEQUAL,
+        &&op_PRINT,
+        &&op_JUMP_IF_FALSE,
+        &&op_JUMP,
+        &&op_JUMP_IF_TRUE,
+        &&op_PUSH_TRUE,
+        &&op_PUSH_FALSE,
+        &&op_ADD_LL,
+        &&op_ADD_K,
+        &&op_SET_LOCAL_POP,
+        &&op_JUMP_IF_NOT_LT,
+        &&op_JUMP_IF_NOT_LE,
+        &&op_JUMP_IF_NOT_GT,
+        &&op_JUMP_IF_NOT_GE,
+        &&op_JUMP_IF_NOT_EQ,
+        &&op_JUMP_IF_NOT_NE,
+        &&op_FOR_RANGE,
+        &&op_FOR_RANGE_L,
+        &&op_ALLOC_PACKED,
+        &&op_ARRAY_FILL,
+        &&op_ARRAY_COPY,
+        &&op_ARRAY_SUM,
+        &&op_ARRAY_MIN,
+        &&op_ARRAY_MAX,
+        &&op_ARRAY_EQUAL,
+        &&op_ARRAY_MAP,
+        &&op_ALLOC_MAP,
+        &&op_MAP_GET,
+        &&op_MAP_SET,
+        &&op_MAP_DEL,
+        &&op_HALT
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == OPCODE_COUNT, "label table out of sync with Opcode");
+
+    // operand slots and unknown opcodes translate to op_INVALID, so a bad jump target fails loudly instead of
+    // executing an operand as an instruction.
+    int len = vm.bc.size();
+    vector<const void*> code(len + 1, &&op_INVALID);
+    for (int i = 0; i < len; i += 1 + operandCount((Opcode) vm.bc[i])){
+        if (vm.bc[i] < 0 || vm.bc[i] >= OPCODE_COUNT) break;
+        code[i] = labels[vm.bc[i]];
+    }
+
+    #define CASE(op) op_##op
+    #define DISPATCH() do { if constexpr (Tracer::enabled) { SYNC(); tracer.record(vm); } goto *code[vm.ip]; } while (0)
+    DISPATCH();
+    {
+        {
+#else
+    #define CASE(op) case Opcode::op
+    #define DISPATCH() continue
+    while (true){
+        assert(vm.ip >= 0 && vm.ip < (int)vm.bc.size());
+        if constexpr (Tracer::enabled) { SYNC(); tracer.record(vm); }
+        switch ((Opcode) vm.bc[vm.ip]){
+#endif
+            CASE(PUSH): {
+                *sp++ = Value::Int(vm.bc[++vm.ip]);
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(POP):{
+                assert(DEPTH() >= 1);
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ADD):{
+                assert(DEPTH() >= 2);
+                assert(sp[-2].isNumber() && sp[-1].isNumber()); // as bool is implicitly convertible to int
+                sp[-2] = Value::Int(sp[-2].asNumber() + sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(SUB):{
+                assert(DEPTH() >= 2);
+                assert(sp[-2].isNumber() && sp[-1].isNumber());
+                sp[-2] = Value::Int(sp[-2].asNumber() - sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(MUL):{
+                assert(DEPTH() >= 2);
+                assert(sp[-2].isNumber() && sp[-1].isNumber());
+                sp[-2] = Value::Int(sp[-2].asNumber() * sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(DIV):{
+                assert(DEPTH() >= 2);
+                assert(sp[-2].isNumber() && sp[-1].isNumber());
+                assert(sp[-1].asNumber() != 0);
+                sp[-2] = Value::Int(sp[-2].asNumber() / sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(MOD):{
+                assert(DEPTH() >= 2);
+                assert(sp[-2].isNumber() && sp[-1].isNumber());
+                assert(sp[-1].asNumber() != 0);
+                sp[-2] = Value::Int(sp[-2].asNumber() % sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(HALT):{
+                SYNC();
+                return;
+            }
+            CASE(CALL):{
+                assert(vm.ip + 3 < (int)vm.bc.size());
+                if (vm.callst.size() == FRAMES_MAX) { SYNC(); cerr << "Call stack overflow\n"; exit(1); }
+                int slots = vm.bc[vm.ip + 2];
+                vm.callst.push_back(callFrame(vm.ip + 3, DEPTH(), slots));
+                fp = sp;
+                for (int i = 0; i < slots; i++) *sp++ = Value::Nil();
+                vm.ip = vm.bc[vm.ip + 1];
+                DISPATCH();
+            }
+            CASE(ALLOC_STRING):{
+                assert((int)vm.bc.size() > vm.ip + 1);
+                int index = vm.bc[++vm.ip];
+                *sp++ = Value::Object(vm.constantObjects[index]); // made at load time and never collected
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ALLOC_ARRAY):{
+                int n = vm.bc[++vm.ip];
+                assert(n >= 0);
+                size_t bytes = ObjHeader::bytesFor(HeapType::ARRAY, n);
+                if (vm.heap.needsCollection(bytes)) { SYNC(); collect(vm, bytes); }
+                *sp++ = Value::Object(vm.heap.allocateArray(n));
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(GET_INDEX):{
+                assert(DEPTH() >= 2);
+                Value n = sp[-1];
+                assert(n.isInt());
+                Value ref = sp[-2];
+                assert(ref.isObject());
+                ObjHeader& arr = vm.heap[ref.asHandle()];
+                assert(n.asInt() < arr.size && n.asInt() >= 0 && (arr.type == HeapType::ARRAY || arr.packed()));
+
+                sp[-2] = arr.type == HeapType::ARRAY ? arr.elements()[n.asInt()] : arr.load(n.asInt());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(SET_INDEX):{
+                assert(DEPTH() >= 3);
+                Value value = sp[-1];
+                Value index = sp[-2];
+                assert(index.isInt());
+                Value ref = sp[-3];
+                assert(ref.isObject());
+                ObjHeader& arr = vm.heap[ref.asHandle()];
+                assert(index.asInt() < arr.size && index.asInt() >= 0 && (arr.type == HeapType::ARRAY || arr.packed()));
+                sp -= 3;
+                if (arr.packed()) { // holds no handles, so no barrier
+                    arr.store(index.asInt(), value);
+                    vm.ip++;
+                    DISPATCH();
+                }
+
+                Value& slot = arr.elements()[index.asInt()];
+                Value previous = slot;
+                slot = value;
+                vm.heap.recordWrite(ref.asHandle(), previous, value);
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(GRTRTHAN):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(sp[-2].asNumber() > sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(GRTREQUAL):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(sp[-2].asNumber() >= sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(EQUAL):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(valuesEqual(sp[-2], sp[-1]));
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(LESSTHAN):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(sp[-2].asNumber() < sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(LESSEQUAL):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(sp[-2].asNumber() <= sp[-1].asNumber());
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(NOTEQUAL):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(!valuesEqual(sp[-2], sp[-1]));
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(GET_LOCAL): {
+                int n = vm.bc[++vm.ip];
+                *sp++ = fp[n];
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(SET_LOCAL):{
+                int n = vm.bc[++vm.ip];
+                assert(DEPTH() >= 1 && n < vm.callst.back().slotCount);
+                fp[n] = sp[-1]; // no pop: we already emit POP after SET_LOCAL, popping here too was a pretty frustrating stack underflow bug
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(NEG):{
+                assert(DEPTH() >= 1 && sp[-1].isInt());
+                sp[-1] = Value::Int(-sp[-1].asInt());
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(NOT):{
+                assert(DEPTH() >= 1 && sp[-1].isBool());
+                sp[-1] = Value::Bool(!sp[-1].asBool());
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(RET):{
+                assert(vm.callst.size() > 1);
+                const callFrame &frame = vm.callst.back();
+                int retIP = frame.returnIP;
+
+                bool hasReturn = sp > fp + frame.slotCount; // anything left above the locals is the return value
+                if (hasReturn) {
+                    Value returnValue = sp[-1]; // only initialise a value if it will correspond to a real runtime value.
+                    sp = fp;
+                    *sp++ = returnValue;
+                } else {
+                    sp = fp;
+                }
+
+                vm.callst.pop_back(); // call stack cleanup, no copy and no free
+                fp = vm.opst.base + vm.callst.back().frameBase;
+                vm.ip = retIP;
+                DISPATCH();
+            }
+            CASE(PRINT): {
+                assert(DEPTH() >= 1);
+                Value v = *--sp;
+
+                switch (v.type()) {
+                    case ValueType::INT:
+                        cout << v.asInt() << "\n";
+                        break;
+                    case ValueType::BOOL:
+                        cout << (v.asBool() ? "true" : "false") << "\n";
+                        break;
+                    case ValueType::NIL:
+                        cout << "nil\n";
+                        break;
+                    default:
+                        if (vm.heap[v.asHandle()].type == HeapType::STRING) cout << vm.heap[v.asHandle()].str() << "\n";
+                        else cout << "<object>\n";
+                }
 
-    vector<HeapObject> heap; //heap
-    VM(){ 
-        ip = 0;
-        callst.push_back(callFrame(-1, 0));
-    }
-};
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(JUMP_IF_FALSE): {
+                assert(DEPTH() >= 1);
+                Value val = *--sp;
+                assert(val.isBool());
 
-queue<int> freedheap;
-void markObject(int ob, VM &vm){
-    assert(ob < vm.heap.size());
-    assert(!vm.heap[ob].free);
-    if (vm.heap[ob].marked) return;
+                int n = vm.bc[++vm.ip];
+                if (!val.asBool()) vm.ip = n;
+                else vm.ip++;
+                DISPATCH();
+            }
+            CASE(JUMP): {
+                int n = vm.bc[++vm.ip];
+                vm.ip = n;
+                DISPATCH();
+            }
+            CASE(JUMP_IF_TRUE): {
+                assert(DEPTH() >= 1);
+                Value val = *--sp;
+                assert(val.isBool());
 
-    vm.heap[ob].marked = true;
-    if (vm.heap[ob].type == HeapType::ARRAY){
-        int n = vm.heap[ob].arr.size();
-        for (int i = 0; i < n; i++){
-            if (vm.heap[ob].arr[i].tag == ValueType::OBJECT) {
-                assert(vm.heap[ob].arr[i].data.objectHandle < vm.heap.size());
-                markObject(vm.heap[ob].arr[i].data.objectHandle, vm);
+                if (val.asBool()) vm.ip = vm.bc[vm.ip + 1];
+                else vm.ip += 2;
+                DISPATCH();
+            }
+            CASE(PUSH_TRUE):{
+                *sp++ = Value::Bool(true);
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(PUSH_FALSE):{
+                *sp++ = Value::Bool(false);
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ADD_LL):{
+                Value a = fp[vm.bc[vm.ip + 1]], b = fp[vm.bc[vm.ip + 2]];
+                assert(a.isNumber() && b.isNumber());
+                *sp++ = Value::Int(a.asNumber() + b.asNumber());
+                vm.ip += 3;
+                DISPATCH();
+            }
+            CASE(ADD_K):{
+                assert(DEPTH() >= 1 && sp[-1].isNumber());
+                sp[-1] = Value::Int(sp[-1].asNumber() + vm.bc[vm.ip + 1]);
+                vm.ip += 2;
+                DISPATCH();
+            }
+            CASE(SET_LOCAL_POP):{
+                assert(DEPTH() >= 1 && vm.bc[vm.ip + 1] < vm.callst.back().slotCount);
+                fp[vm.bc[vm.ip + 1]] = *--sp;
+                vm.ip += 2;
+                DISPATCH();
+            }
+    #define COMPARE_JUMP(test) { \
+                assert(DEPTH() >= 2); \
+                Value a = sp[-2], b = sp[-1]; \
+                sp -= 2; \
+                if (test) vm.ip += 2; \
+                else vm.ip = vm.bc[vm.ip + 1]; \
+                DISPATCH(); }
+            CASE(JUMP_IF_NOT_LT): COMPARE_JUMP(a.asNumber() < b.asNumber())
+            CASE(JUMP_IF_NOT_LE): COMPARE_JUMP(a.asNumber() <= b.asNumber())
+            CASE(JUMP_IF_NOT_GT): COMPARE_JUMP(a.asNumber() > b.asNumber())
+            CASE(JUMP_IF_NOT_GE): COMPARE_JUMP(a.asNumber() >= b.asNumber())
+            CASE(JUMP_IF_NOT_EQ): COMPARE_JUMP(valuesEqual(a, b))
+            CASE(JUMP_IF_NOT_NE): COMPARE_JUMP(!valuesEqual(a, b))
+    #undef COMPARE_JUMP
+            CASE(FOR_RANGE):{
+                Value &counter = fp[vm.bc[vm.ip + 1]];
+                assert(counter.isNumber());
+                counter = Value::Int(counter.asNumber() + 1);
+                if (counter.asInt() < vm.bc[vm.ip + 2]) vm.ip = vm.bc[vm.ip + 3];
+                else vm.ip += 4;
+                DISPATCH();
+            }
+            CASE(FOR_RANGE_L):{
+                Value &counter = fp[vm.bc[vm.ip + 1]];
+                assert(counter.isNumber());
+                counter = Value::Int(counter.asNumber() + 1);
+                if (counter.asInt() < fp[vm.bc[vm.ip + 2]].asNumber()) vm.ip = vm.bc[vm.ip + 3];
+                else vm.ip += 4;
+                DISPATCH();
+            }
+            CASE(ALLOC_PACKED):{
+                int n = vm.bc[vm.ip + 1];
+                HeapType type = (HeapType)vm.bc[vm.ip + 2];
+                assert(n >= 0 && type >= HeapType::INT32_ARRAY && type <= HeapType::BOOL_ARRAY);
+                size_t bytes = ObjHeader::bytesFor(type, n);
+                if (vm.heap.needsCollection(bytes)) { SYNC(); collect(vm, bytes); }
+                *sp++ = Value::Object(vm.heap.allocatePacked(type, n));
+                vm.ip += 3;
+                DISPATCH();
+            }
+    // the packed array `v` refers to
+    #define PACKED(v) (assert((v).isObject() && vm.heap[(v).asHandle()].packed()), vm.heap[(v).asHandle()])
+            CASE(ARRAY_FILL):{
+                assert(DEPTH() >= 2);
+                fillPacked(PACKED(sp[-2]), sp[-1]);
+                sp -= 2;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ARRAY_COPY):{
+                assert(DEPTH() >= 2);
+                copyPacked(PACKED(sp[-2]), PACKED(sp[-1]));
+                sp -= 2;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ARRAY_SUM):{
+                assert(DEPTH() >= 1);
+                sp[-1] = Value::Int((vmint)sumPacked(PACKED(sp[-1])));
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ARRAY_MIN):
+            CASE(ARRAY_MAX):{
+                assert(DEPTH() >= 1);
+                ObjHeader& arr = PACKED(sp[-1]);
+                bool largest = (Opcode)vm.bc[vm.ip] == Opcode::ARRAY_MAX;
+                sp[-1] = arr.size == 0 ? Value::Nil() : Value::Int((vmint)minMaxPacked(arr, largest));
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ARRAY_EQUAL):{
+                assert(DEPTH() >= 2);
+                sp[-2] = Value::Bool(equalPacked(PACKED(sp[-2]), PACKED(sp[-1])));
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(ARRAY_MAP):{
+                assert(DEPTH() >= 2 && sp[-1].isInt());
+                mapPacked(PACKED(sp[-2]), (Opcode)vm.bc[vm.ip + 1], sp[-1].asInt());
+                sp -= 2;
+                vm.ip += 2;
+                DISPATCH();
+            }
+    #undef PACKED
+    // the map `v` refers to, and the hash of a key that may be used with it
+    #define MAP(v) (assert((v).isObject() && vm.heap[(v).asHandle()].type == HeapType::MAP), vm.heap[(v).asHandle()])
+    #define KEY_HASH(k) (assert(!(k).isObject() || (k).asHandle() < vm.heap.permanent), hashKey(k))
+            CASE(ALLOC_MAP):{
+                int n = vm.bc[vm.ip + 1];
+                assert(n >= 0);
+                size_t capacity = mapCapacityFor(n), table = mapTableBytes(capacity);
+                if (vm.heap.needsCollection(ObjHeader::bytesFor(HeapType::MAP, 0)) || vm.heap.needsCollection(table, true)){
+                    SYNC();
+                    collect(vm, table, true);
+                }
+                *sp++ = Value::Object(vm.heap.allocateMap(capacity));
+                vm.ip += 2;
+                DISPATCH();
+            }
+            CASE(MAP_GET):{
+                assert(DEPTH() >= 2);
+                ObjHeader& m = MAP(sp[-2]);
+                int i = mapFind(m, sp[-1], KEY_HASH(sp[-1]));
+                sp[-2] = i < 0 ? Value::Nil() : m.map().slots[2 * i + 1];
+                sp--;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(MAP_SET):{
+                assert(DEPTH() >= 3);
+                uint64_t hash = KEY_HASH(sp[-2]);
+                int i = mapFind(MAP(sp[-3]), sp[-2], hash);
+                if (i < 0 && MAP(sp[-3]).map().growthLeft == 0){
+                    ObjHeader& m = MAP(sp[-3]);
+                    size_t capacity = m.map().count * 2 < m.size ? m.size : 2 * (size_t)m.size;
+                    size_t table = mapTableBytes(capacity);
+                    if (vm.heap.needsCollection(table, true)) { SYNC(); collect(vm, table, true); } // may move the map
+                    vm.heap.rehashMap(sp[-3].asHandle(), capacity);
+                }
+                int h = sp[-3].asHandle();
+                ObjHeader& m = vm.heap[h];
+                Value previous;
+                if (i < 0){
+                    i = mapClaim(m, hash);
+                    m.map().slots[2 * i] = sp[-2];
+                    vm.heap.recordWrite(h, Value::Nil(), sp[-2]);
+                }
+                else previous = m.map().slots[2 * i + 1];
+                m.map().slots[2 * i + 1] = sp[-1];
+                vm.heap.recordWrite(h, previous, sp[-1]);
+                sp -= 3;
+                vm.ip++;
+                DISPATCH();
+            }
+            CASE(MAP_DEL):{
+                assert(DEPTH() >= 2);
+                ObjHeader& m = MAP(sp[-2]);
+                int i = mapFind(m, sp[-1], KEY_HASH(sp[-1]));
+                if (i >= 0){
+                    Value key = m.map().slots[2 * i], value = m.map().slots[2 * i + 1];
+                    mapErase(m, i);
+                    vm.heap.recordWrite(sp[-2].asHandle(), key, Value::Nil());
+                    vm.heap.recordWrite(sp[-2].asHandle(), value, Value::Nil());
+                }
+                sp -= 2;
+                vm.ip++;
+                DISPATCH();
+            }
+    #undef MAP
+    #undef KEY_HASH
+#if VM_THREADED_DISPATCH
+            op_INVALID:{
+                SYNC();
+                perror("Wrong opcode");
+                return;
+            }
+#else
+            default:{
+                SYNC();
+                perror("Wrong opcode");
+                return;
             }
+#endif
         }
     }
+#undef CASE
+#undef DISPATCH
+#undef SYNC
+#undef DEPTH
 }
-void markRoots(VM &vm){
-    int n = vm.opst.size();
-    for (const auto& val : vm.opst) {
-        if (val.tag == ValueType::OBJECT) markObject(val.data.objectHandle, vm);
+
+
+// Register tier (--tier=reg). A translation pass turns the stack bytecode into three-address instructions that work
+// directly on frame slots, e.g. "GET_LOCAL a; GET_LOCAL b; ADD; SET_LOCAL a; POP" becomes "ADD a, a, b".
+// The register file is the top-level frame's window on the operand stack: [locals | constants | temporaries].
+// Constants are preloaded once, and the temporary for operand stack depth d is always register tempBase + d.
+enum class RegOp {
+    MOVE,                       // MOVE d, s
+    ADD, SUB, MUL, DIV, MOD,    // op d, a, b
+    LT, LE, GT, GE, EQ, NE,     // op d, a, b
+    NEG, NOT,                   // op d, a
+    JMP,                        // JMP target
+    JMPF,                       // JMPF a, target
+    JMPT,                       // JMPT a, target
+    LT_JMPF, LE_JMPF, GT_JMPF, GE_JMPF, EQ_JMPF, NE_JMPF, // op a, b, target: jump unless (a op b)
+    PRINT,                      // PRINT a
+    HALT
+};
+constexpr int REGOP_COUNT = (int)RegOp::HALT + 1;
+
+int regOperandCount(RegOp op){
+    switch (op){
+        case RegOp::ADD: case RegOp::SUB: case RegOp::MUL: case RegOp::DIV: case RegOp::MOD:
+        case RegOp::LT: case RegOp::LE: case RegOp::GT: case RegOp::GE: case RegOp::EQ: case RegOp::NE:
+        case RegOp::LT_JMPF: case RegOp::LE_JMPF: case RegOp::GT_JMPF: case RegOp::GE_JMPF:
+        case RegOp::EQ_JMPF: case RegOp::NE_JMPF:
+            return 3;
+        case RegOp::MOVE: case RegOp::NEG: case RegOp::NOT: case RegOp::JMPF: case RegOp::JMPT:
+            return 2;
+        case RegOp::JMP: case RegOp::PRINT:
+            return 1;
+        case RegOp::HALT:
+            return 0;
     }
-    for (const auto& x : vm.callst){
-        for (const auto& v : x.locals){
-            if (v.tag == ValueType::OBJECT) markObject(v.data.objectHandle, vm); // marking locals on the callstack.
-        }
+    return 0;
+}
+
+bool hasDest(RegOp op){ // first operand is the register written
+    switch (op){
+        case RegOp::JMP: case RegOp::JMPF: case RegOp::JMPT: case RegOp::PRINT: case RegOp::HALT:
+        case RegOp::LT_JMPF: case RegOp::LE_JMPF: case RegOp::GT_JMPF: case RegOp::GE_JMPF:
+        case RegOp::EQ_JMPF: case RegOp::NE_JMPF:
+            return false;
+        default:
+            return true;
     }
 }
-void collectGarbage(VM &vm){
-    // Mark Phase (recursive):
-    markRoots(vm);
-    // Sweep Phase:
-    int n = vm.heap.size();
-    for (int i = 0; i < n; i++){
-        if (!vm.heap[i].marked) {
-            vm.heap[i].free = true;
-            freedheap.push(i);
-            if (vm.heap[i].type == HeapType::ARRAY) vm.heap[i].arr.erase(vm.heap[i].arr.begin(), vm.heap[i].arr.end());
-            else vm.heap[i].st.erase();
-            allocatedSinceLastGC--;
-        }
-        else vm.heap[i].marked = false;
+
+const char* regOpName(RegOp op){
+    switch (op){
+        case RegOp::MOVE: return "MOVE";
+        case RegOp::ADD: return "ADD";
+        case RegOp::SUB: return "SUB";
+        case RegOp::MUL: return "MUL";
+        case RegOp::DIV: return "DIV";
+        case RegOp::MOD: return "MOD";
+        case RegOp::LT: return "LT";
+        case RegOp::LE: return "LE";
+        case RegOp::GT: return "GT";
+        case RegOp::GE: return "GE";
+        case RegOp::EQ: return "EQ";
+        case RegOp::NE: return "NE";
+        case RegOp::NEG: return "NEG";
+        case RegOp::NOT: return "NOT";
+        case RegOp::JMP: return "JMP";
+        case RegOp::JMPF: return "JMPF";
+        case RegOp::JMPT: return "JMPT";
+        case RegOp::LT_JMPF: return "LT_JMPF";
+        case RegOp::LE_JMPF: return "LE_JMPF";
+        case RegOp::GT_JMPF: return "GT_JMPF";
+        case RegOp::GE_JMPF: return "GE_JMPF";
+        case RegOp::EQ_JMPF: return "EQ_JMPF";
+        case RegOp::NE_JMPF: return "NE_JMPF";
+        case RegOp::PRINT: return "PRINT";
+        case RegOp::HALT: return "HALT";
     }
+    return "???";
 }
 
-int main (){
-    VM vm;
-    ifstream file("program.vm");
-    string src(
-        (istreambuf_iterator<char>(file)),
-        istreambuf_iterator<char>()
-    ); // take the entire program as input string.
-    Lexer lexer(src);
-    vector<Token> tokens = lexer.scanTokens();
-    Parser parser(tokens);
-    vector<Stmt*> stmts = parser.parseProgram();
-    Compiler c;
-    vm.bc = c.compileProgram(stmts);
-    vm.callst.push_back(callFrame(0, 0));
-    for (auto x : c.bytecode) cout << x << " "; cout << "\n";
-
-    bool running = true;
-    while (running){
-        assert(vm.ip >= 0 && vm.ip < vm.bc.size());
-        Opcode oc = (Opcode) vm.bc[vm.ip];
-        switch (oc){
-            case Opcode::PUSH: {
-                Value value = Value::Int(vm.bc[++vm.ip]);
-                vm.opst.push_back(value);
-
-                cout << "Pushed " << value.data.intVal << endl; // all such prints are for debugging purposes
-                vm.ip++;
-                continue;
-            }
-            case Opcode::POP:{
-                assert(vm.opst.size() >= 1);
-                vm.opst.pop_back();
+void FileTrace::recordRegister(const VM&, int pc, int op){
+    out << "pc=" << pc << " rop=" << (op >= 0 && op < REGOP_COUNT ? regOpName((RegOp)op) : "???") << "\n";
+}
 
-                cout << "Popped" << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::ADD:{
-                assert(vm.opst.size() >= 2);
-                Value op2 = vm.opst.back();
-                assert(op2.tag == ValueType::INT || op2.tag == ValueType::BOOL); // as bool is implicitly convertible to int
-                vm.opst.pop_back();
-
-                Value op1 = vm.opst.back();
-                assert(op1.tag == ValueType::INT || op1.tag == ValueType::BOOL);
-                vm.opst.pop_back();
-                op1.data.intVal = (op1.tag == ValueType::BOOL ? (int)op1.data.boolVal : op1.data.intVal);
-                op2.data.intVal = (op2.tag == ValueType::BOOL ? (int)op2.data.boolVal : op2.data.intVal);
-                vm.opst.push_back(Value::Int(op1.data.intVal+op2.data.intVal));
-
-                cout << "Added " << op1.data.intVal << " and " << op2.data.intVal << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::SUB:{
-                assert(vm.opst.size() >= 2);
-                Value op2 = vm.opst.back();
-                assert(op2.tag == ValueType::INT || op2.tag == ValueType::BOOL);
-                vm.opst.pop_back();
+struct RegProgram {
+    vector<int> code;
+    vector<Value> constants; // preloaded into registers [localCount, localCount + constants.size())
+    int localCount = 0;
+    int registerCount = 0;
+};
 
-                Value op1 = vm.opst.back();
-                assert(op1.tag == ValueType::INT || op1.tag == ValueType::BOOL);
-                vm.opst.pop_back();
+class RegisterTranslator {
+    public:
+    CodeView bc;
+    RegProgram& out;
+    string error; // why translation gave up, if it did
 
-                op1.data.intVal = (op1.tag == ValueType::BOOL ? (int)op1.data.boolVal : op1.data.intVal);
-                op2.data.intVal = (op2.tag == ValueType::BOOL ? (int)op2.data.boolVal : op2.data.intVal);
-                vm.opst.push_back(Value::Int(op1.data.intVal-op2.data.intVal));
+    int tempBase = 0;
+    vector<int> stack;                 // register currently holding each abstract operand stack slot
+    unordered_map<int, int> constRegs; // constant value -> register
+    int boolRegs[2] = {-1, -1};        // registers holding false and true
+    vector<int> regPos;                // stack bytecode offset -> register code offset
+    vector<int> targetDepth;           // operand stack depth expected at each jump target
+    vector<pair<int, int>> fixups;     // (register code index of a jump operand, stack bytecode target)
+    int lastStart = -1;                // start of the last emitted instruction, -1 after a label
 
-                cout << "Subtracted " << op1.data.intVal << " and " << op2.data.intVal << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::MUL:{
-                assert(vm.opst.size() >= 2);
-                Value op2 = vm.opst.back();
-                assert(op2.tag == ValueType::INT || op2.tag == ValueType::BOOL);
-                vm.opst.pop_back();
+    RegisterTranslator(CodeView b, RegProgram& o) : bc(b), out(o) {}
 
-                Value op1 = vm.opst.back();
-                assert(op1.tag == ValueType::INT || op1.tag == ValueType::BOOL);
-                vm.opst.pop_back();
+    int temp(int depth){ return tempBase + depth; }
+    void emit(RegOp op, initializer_list<int> operands){
+        lastStart = out.code.size();
+        out.code.push_back((int)op);
+        for (int x : operands) out.code.push_back(x);
+    }
+    void materialize(int d){ // make slot d live in its own temporary
+        if (stack[d] == temp(d)) return;
+        emit(RegOp::MOVE, {temp(d), stack[d]});
+        stack[d] = temp(d);
+    }
+    void flush(){ // canonical state: every slot in its temporary, required wherever control flow merges
+        for (int d = 0; d < (int)stack.size(); d++) materialize(d);
+    }
+    bool noteTarget(int target){ // false if another path reaches target with a different stack depth
+        if (targetDepth[target] == -1) targetDepth[target] = stack.size();
+        return targetDepth[target] == (int)stack.size();
+    }
+    void emitJump(RegOp op, initializer_list<int> operands, int target){
+        emit(op, operands);
+        fixups.push_back({(int)out.code.size(), target});
+        out.code.push_back(-1);
+    }
+    void binary(RegOp op){
+        int b = stack.back(); stack.pop_back();
+        int a = stack.back(); stack.pop_back();
+        int d = temp(stack.size());
+        emit(op, {d, a, b});
+        stack.push_back(d);
+    }
+    bool fail(const string& why){ error = why; return false; }
 
-                op1.data.intVal = (op1.tag == ValueType::BOOL ? (int)op1.data.boolVal : op1.data.intVal);
-                op2.data.intVal = (op2.tag == ValueType::BOOL ? (int)op2.data.boolVal : op2.data.intVal);
-                vm.opst.push_back(Value::Int(op1.data.intVal*op2.data.intVal));
+    bool translate(int localCount){
+        int len = bc.size();
+        out = RegProgram();
+        out.localCount = localCount;
 
-                cout << "Multiplied " << op1.data.intVal << " and " << op2.data.intVal << endl;
-                vm.ip++;
-                continue;
+        // pass 1: check every opcode is supported, collect constants and jump targets
+        vector<bool> isTarget(len + 1, false);
+        for (int i = 0; i < len; i += 1 + operandCount((Opcode) bc[i])){
+            if (bc[i] < 0 || bc[i] >= OPCODE_COUNT) return fail("invalid opcode");
+            Opcode op = (Opcode) bc[i];
+            switch (op){
+                case Opcode::PUSH:
+                    if (!constRegs.count(bc[i + 1])){
+                        constRegs[bc[i + 1]] = localCount + out.constants.size();
+                        out.constants.push_back(Value::Int(bc[i + 1]));
+                    }
+                    break;
+                case Opcode::PUSH_TRUE: case Opcode::PUSH_FALSE: {
+                    bool b = op == Opcode::PUSH_TRUE;
+                    if (boolRegs[b] == -1){
+                        boolRegs[b] = localCount + out.constants.size();
+                        out.constants.push_back(Value::Bool(b));
+                    }
+                    break;
+                }
+                case Opcode::JUMP: case Opcode::JUMP_IF_FALSE: case Opcode::JUMP_IF_TRUE:
+                    if (bc[i + 1] < 0 || bc[i + 1] > len) return fail("jump out of range");
+                    isTarget[bc[i + 1]] = true;
+                    break;
+                case Opcode::POP: case Opcode::NEG: case Opcode::NOT:
+                case Opcode::ADD: case Opcode::SUB: case Opcode::MUL: case Opcode::DIV: case Opcode::MOD:
+                case Opcode::LESSTHAN: case Opcode::LESSEQUAL: case Opcode::GRTRTHAN: case Opcode::GRTREQUAL:
+                case Opcode::EQUAL: case Opcode::NOTEQUAL:
+                case Opcode::GET_LOCAL: case Opcode::SET_LOCAL: case Opcode::PRINT: case Opcode::HALT:
+                    break;
+                default:
+                    return fail(string("unsupported opcode ") + opcodeName(op));
             }
-            case Opcode::DIV:{
-                assert(vm.opst.size() >= 2);
-                Value op2 = vm.opst.back();
-                assert(op2.tag == ValueType::INT || op2.tag == ValueType::BOOL);
-                assert(op2.data.intVal != 0);
-                vm.opst.pop_back();
-
-                Value op1 = vm.opst.back();
-                assert(op1.tag == ValueType::INT || op1.tag == ValueType::BOOL);
-                vm.opst.pop_back();
+        }
+        tempBase = localCount + out.constants.size();
+        regPos.assign(len + 1, -1);
+        targetDepth.assign(len + 1, -1);
 
-                op1.data.intVal = (op1.tag == ValueType::BOOL ? (int)op1.data.boolVal : op1.data.intVal);
-                op2.data.intVal = (op2.tag == ValueType::BOOL ? (int)op2.data.boolVal : op2.data.intVal);
-                vm.opst.push_back(Value::Int(op1.data.intVal/op2.data.intVal));
+        // pass 2: abstract interpretation of the operand stack
+        int maxDepth = 0;
+        bool reachable = true; // can control fall into the current instruction?
+        for (int i = 0; i < len; i += 1 + operandCount((Opcode) bc[i])){
+            if (isTarget[i]){
+                if (reachable){
+                    flush();
+                    if (targetDepth[i] != -1 && targetDepth[i] != (int)stack.size()) return fail("inconsistent stack depth");
+                    targetDepth[i] = stack.size();
+                }
+                else {
+                    if (targetDepth[i] == -1) targetDepth[i] = 0; // only reached by a later jump, which must agree
+                    stack.clear();
+                    for (int d = 0; d < targetDepth[i]; d++) stack.push_back(temp(d));
+                }
+                lastStart = -1; // never fuse across a label
+                reachable = true;
+            }
+            else if (!reachable) continue; // dead code
+            regPos[i] = out.code.size();
 
-                cout << "Divided " << op1.data.intVal << " and " << op2.data.intVal << endl;
-                vm.ip++;
-                continue;
+            Opcode op = (Opcode) bc[i];
+            switch (op){
+                case Opcode::PUSH: stack.push_back(constRegs[bc[i + 1]]); break;
+                case Opcode::PUSH_TRUE: stack.push_back(boolRegs[1]); break;
+                case Opcode::PUSH_FALSE: stack.push_back(boolRegs[0]); break;
+                case Opcode::GET_LOCAL: stack.push_back(bc[i + 1]); break;
+                case Opcode::POP:
+                    if (stack.empty()) return fail("stack underflow");
+                    stack.pop_back();
+                    break;
+                case Opcode::SET_LOCAL: {
+                    int n = bc[i + 1];
+                    if (stack.empty()) return fail("stack underflow");
+                    for (int d = 0; d + 1 < (int)stack.size(); d++){
+                        if (stack[d] == n) materialize(d); // slots still reading the old value keep it
+                    }
+                    int top = stack.back();
+                    if (top == n) break;
+                    if (lastStart != -1 && hasDest((RegOp)out.code[lastStart])
+                        && out.code[lastStart + 1] == top && top == temp(stack.size() - 1)){
+                        out.code[lastStart + 1] = n; // compute straight into the local instead of temp + MOVE
+                    }
+                    else emit(RegOp::MOVE, {n, top});
+                    stack.back() = n;
+                    break;
+                }
+                case Opcode::ADD: binary(RegOp::ADD); break;
+                case Opcode::SUB: binary(RegOp::SUB); break;
+                case Opcode::MUL: binary(RegOp::MUL); break;
+                case Opcode::DIV: binary(RegOp::DIV); break;
+                case Opcode::MOD: binary(RegOp::MOD); break;
+                case Opcode::LESSTHAN: binary(RegOp::LT); break;
+                case Opcode::LESSEQUAL: binary(RegOp::LE); break;
+                case Opcode::GRTRTHAN: binary(RegOp::GT); break;
+                case Opcode::GRTREQUAL: binary(RegOp::GE); break;
+                case Opcode::EQUAL: binary(RegOp::EQ); break;
+                case Opcode::NOTEQUAL: binary(RegOp::NE); break;
+                case Opcode::NEG: case Opcode::NOT: {
+                    int a = stack.back(); stack.pop_back();
+                    int d = temp(stack.size());
+                    emit(op == Opcode::NEG ? RegOp::NEG : RegOp::NOT, {d, a});
+                    stack.push_back(d);
+                    break;
+                }
+                case Opcode::PRINT: {
+                    int a = stack.back(); stack.pop_back();
+                    emit(RegOp::PRINT, {a});
+                    break;
+                }
+                case Opcode::JUMP:
+                    flush();
+                    if (!noteTarget(bc[i + 1])) return fail("inconsistent stack depth");
+                    emitJump(RegOp::JMP, {}, bc[i + 1]);
+                    reachable = false;
+                    break;
+                case Opcode::JUMP_IF_FALSE: {
+                    int cond = stack.back(); stack.pop_back();
+                    int target = bc[i + 1];
+                    // "a < b; JUMP_IF_FALSE" fuses into one compare-and-branch when the compare was the last
+                    // instruction and wrote the condition's temporary.
+                    RegOp fused = RegOp::HALT;
+                    if (lastStart != -1 && out.code[lastStart + 1] == cond && cond == temp(stack.size())){
+                        switch ((RegOp)out.code[lastStart]){
+                            case RegOp::LT: fused = RegOp::LT_JMPF; break;
+                            case RegOp::LE: fused = RegOp::LE_JMPF; break;
+                            case RegOp::GT: fused = RegOp::GT_JMPF; break;
+                            case RegOp::GE: fused = RegOp::GE_JMPF; break;
+                            case RegOp::EQ: fused = RegOp::EQ_JMPF; break;
+                            case RegOp::NE: fused = RegOp::NE_JMPF; break;
+                            default: break;
+                        }
+                    }
+                    if (fused != RegOp::HALT){
+                        int a = out.code[lastStart + 2], b = out.code[lastStart + 3];
+                        out.code.resize(lastStart);
+                        flush(); // only writes temporaries below the condition, so a and b are untouched
+                        if (!noteTarget(target)) return fail("inconsistent stack depth");
+                        emitJump(fused, {a, b}, target);
+                    }
+                    else {
+                        flush();
+                        if (!noteTarget(target)) return fail("inconsistent stack depth");
+                        emitJump(RegOp::JMPF, {cond}, target);
+                    }
+                    break;
+                }
+                case Opcode::JUMP_IF_TRUE: {
+                    int cond = stack.back(); stack.pop_back();
+                    flush();
+                    if (!noteTarget(bc[i + 1])) return fail("inconsistent stack depth");
+                    emitJump(RegOp::JMPT, {cond}, bc[i + 1]);
+                    break;
+                }
+                case Opcode::HALT:
+                    emit(RegOp::HALT, {});
+                    reachable = false;
+                    break;
+                default:
+                    return fail(string("unsupported opcode ") + opcodeName(op));
             }
-            case Opcode::MOD:{
-                assert(vm.opst.size() >= 2);
-                Value op2 = vm.opst.back();
-                assert((op2.tag == ValueType::INT || op2.tag == ValueType::BOOL));
-                assert(op2.data.intVal != 0);
-                vm.opst.pop_back();
+            maxDepth = max(maxDepth, (int)stack.size());
+        }
+        regPos[len] = out.code.size();
+        emit(RegOp::HALT, {});
+
+        for (auto& f : fixups){
+            if (regPos[f.second] == -1) return fail("jump into dead code");
+            out.code[f.first] = regPos[f.second];
+        }
+        out.registerCount = tempBase + maxDepth + 1;
+        return true;
+    }
+};
 
-                Value op1 = vm.opst.back();
-                assert(op1.tag == ValueType::INT || op1.tag == ValueType::BOOL);
-                vm.opst.pop_back();
+template <class Tracer>
+void runRegisters(VM &vm, const RegProgram &prog, Tracer &tracer){
+    Value* r = vm.opst.base + vm.callst.back().frameBase; // register file = the frame's window
+    assert((int)vm.opst.size() - vm.callst.back().frameBase >= prog.registerCount);
+    for (size_t i = 0; i < prog.constants.size(); i++) r[prog.localCount + i] = prog.constants[i];
+    const int* code = prog.code.data();
+    int pc = 0;
 
-                op1.data.intVal = (op1.tag == ValueType::BOOL ? (int)op1.data.boolVal : op1.data.intVal);
-                op2.data.intVal = (op2.tag == ValueType::BOOL ? (int)op2.data.boolVal : op2.data.intVal);
-                vm.opst.push_back(Value::Int(op1.data.intVal%op2.data.intVal));
+#if VM_THREADED_DISPATCH
+    static const void* labels[] = { // indexed by RegOp, must stay in enum order
+        &&rop_MOVE, &&rop_ADD, &&rop_SUB, &&rop_MUL, &&rop_DIV, &&rop_MOD,
+        &&rop_LT, &&rop_LE, &&rop_GT, &&rop_GE, &&rop_EQ, &&rop_NE,
+        &&rop_NEG, &&rop_NOT, &&rop_JMP, &&rop_JMPF, &&rop_JMPT,
+        &&rop_LT_JMPF, &&rop_LE_JMPF, &&rop_GT_JMPF, &&rop_GE_JMPF, &&rop_EQ_JMPF, &&rop_NE_JMPF,
+        &&rop_PRINT, &&rop_HALT
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == REGOP_COUNT, "label table out of sync with RegOp");
+    int len = prog.code.size();
+    vector<const void*> handlers(len, &&rop_HALT);
+    for (int i = 0; i < len; i += 1 + regOperandCount((RegOp) code[i])) handlers[i] = labels[code[i]];
 
-                cout << "Mod " << op1.data.intVal << " and " << op2.data.intVal << endl;
-                vm.ip++;
-                continue;
+    #define CASE(op) rop_##op
+    #define DISPATCH() do { if constexpr (Tracer::enabled) tracer.recordRegister(vm, pc, code[pc]); goto *handlers[pc]; } while (0)
+    DISPATCH();
+    {
+        {
+#else
+    #define CASE(op) case RegOp::op
+    #define DISPATCH() continue
+    while (true){
+        if constexpr (Tracer::enabled) tracer.recordRegister(vm, pc, code[pc]);
+        switch ((RegOp) code[pc]){
+#endif
+    #define BINARY(op, make) { \
+                Value a = r[code[pc + 2]], b = r[code[pc + 3]]; \
+                assert(a.isNumber() && b.isNumber()); \
+                r[code[pc + 1]] = make(a.asNumber() op b.asNumber()); \
+                pc += 4; \
+                DISPATCH(); }
+    // comparisons never fail: like the stack tier's they read any Value through asNumber
+    #define COMPARE(test) { \
+                Value a = r[code[pc + 2]], b = r[code[pc + 3]]; \
+                r[code[pc + 1]] = Value::Bool(test); \
+                pc += 4; \
+                DISPATCH(); }
+    #define COMPARE_JUMP(test) { \
+                Value a = r[code[pc + 1]], b = r[code[pc + 2]]; \
+                if (test) pc += 4; \
+                else pc = code[pc + 3]; \
+                DISPATCH(); }
+            CASE(MOVE):{
+                r[code[pc + 1]] = r[code[pc + 2]];
+                pc += 3;
+                DISPATCH();
             }
-            case Opcode::HALT:{
-                running = false;
-                break;
+            CASE(ADD): BINARY(+, Value::Int)
+            CASE(SUB): BINARY(-, Value::Int)
+            CASE(MUL): BINARY(*, Value::Int)
+            CASE(DIV):{
+                assert(r[code[pc + 3]].asNumber() != 0);
+                BINARY(/, Value::Int)
             }
-            case Opcode::CALL:{
-                assert(vm.ip + 2 < vm.bc.size());
-                callFrame cf(vm.ip + 2, vm.opst.size());
-                vm.callst.push_back(cf);
-                vm.ip = vm.bc[vm.ip + 1];
-
-                cout << "Called @ " << vm.ip << endl;
-                continue;
+            CASE(MOD):{
+                assert(r[code[pc + 3]].asNumber() != 0);
+                BINARY(%, Value::Int)
             }
-            case Opcode::ALLOC_STRING:{
-                assert(vm.bc.size() > vm.ip + 1);
-                int index = vm.bc[++vm.ip];
-                string str = vm.constants[index]; //bytecode references strings in a constant pool, since it cannot pass strings on its own.
-                int handle = (!freedheap.empty() ? freedheap.front() :  vm.heap.size());
-                if (!freedheap.empty()) freedheap.pop();
-                vm.heap.push_back(HeapObject::String(str));
-                allocatedSinceLastGC++;
-                if (allocatedSinceLastGC > 50) collectGarbage(vm);
-                vm.opst.push_back(Value::Object(handle));
-
-                cout << "Allocated string" << str << endl;
-                continue;
-            }
-            case Opcode::ALLOC_ARRAY:{
-                int n = vm.bc[++vm.ip];
-                int handle = (!freedheap.empty() ? freedheap.front() :  vm.heap.size());
-                if (!freedheap.empty()) freedheap.pop();
-                vm.heap.push_back(HeapObject::Array(n));
-                allocatedSinceLastGC++;
-                if (allocatedSinceLastGC > 50) collectGarbage(vm);
-                vm.opst.push_back(Value::Object(handle));
-
-                cout << "Allocated array " << endl;
-                continue;
-            }
-            case Opcode::GET_INDEX:{
-                Value n = vm.opst.back();
-                assert(n.tag == ValueType::INT);
-                vm.opst.pop_back();
-                
-                Value ref = vm.opst.back();
-                assert(ref.tag == ValueType::OBJECT);
-                vm.opst.pop_back();
-                assert(n.data.intVal < vm.heap[ref.data.objectHandle].arr.size() && n.data.intVal >= 0 
-                && vm.heap[ref.data.objectHandle].type == HeapType::ARRAY);
+            CASE(LT): COMPARE(a.asNumber() < b.asNumber())
+            CASE(LE): COMPARE(a.asNumber() <= b.asNumber())
+            CASE(GT): COMPARE(a.asNumber() > b.asNumber())
+            CASE(GE): COMPARE(a.asNumber() >= b.asNumber())
+            CASE(EQ): COMPARE(valuesEqual(a, b))
+            CASE(NE): COMPARE(!valuesEqual(a, b))
+            CASE(NEG):{
+                assert(r[code[pc + 2]].isInt());
+                r[code[pc + 1]] = Value::Int(-r[code[pc + 2]].asInt());
+                pc += 3;
+                DISPATCH();
+            }
+            CASE(NOT):{
+                assert(r[code[pc + 2]].isBool());
+                r[code[pc + 1]] = Value::Bool(!r[code[pc + 2]].asBool());
+                pc += 3;
+                DISPATCH();
+            }
+            CASE(JMP):{
+                pc = code[pc + 1];
+                DISPATCH();
+            }
+            CASE(JMPF):{
+                assert(r[code[pc + 1]].isBool());
+                if (r[code[pc + 1]].asBool()) pc += 3;
+                else pc = code[pc + 2];
+                DISPATCH();
+            }
+            CASE(JMPT):{
+                assert(r[code[pc + 1]].isBool());
+                if (r[code[pc + 1]].asBool()) pc = code[pc + 2];
+                else pc += 3;
+                DISPATCH();
+            }
+            CASE(LT_JMPF): COMPARE_JUMP(a.asNumber() < b.asNumber())
+            CASE(LE_JMPF): COMPARE_JUMP(a.asNumber() <= b.asNumber())
+            CASE(GT_JMPF): COMPARE_JUMP(a.asNumber() > b.asNumber())
+            CASE(GE_JMPF): COMPARE_JUMP(a.asNumber() >= b.asNumber())
+            CASE(EQ_JMPF): COMPARE_JUMP(valuesEqual(a, b))
+            CASE(NE_JMPF): COMPARE_JUMP(!valuesEqual(a, b))
+            CASE(PRINT):{
+                Value v = r[code[pc + 1]];
+                switch (v.type()) {
+                    case ValueType::INT: cout << v.asInt() << "\n"; break;
+                    case ValueType::BOOL: cout << (v.asBool() ? "true" : "false") << "\n"; break;
+                    case ValueType::NIL: cout << "nil\n"; break;
+                    default: cout << "<object>\n";
+                }
+                pc += 2;
+                DISPATCH();
+            }
+            CASE(HALT):{
+                return;
+            }
+#if !VM_THREADED_DISPATCH
+            default:{
+                perror("Wrong register opcode");
+                return;
+            }
+#endif
+        }
+    }
+#undef BINARY
+#undef COMPARE
+#undef COMPARE_JUMP
+#undef CASE
+#undef DISPATCH
+}
 
-                Value fetch = vm.heap[ref.data.objectHandle].arr[n.data.intVal];
-                vm.opst.push_back(fetch);
+// Runs a compiled program in a fresh VM, on the register tier when a translation is given.
+template <class Tracer>
+void execute(CodeView bc, int localCount, const RegProgram* reg, Tracer& tracer,
+             const vector<string>& constants = {}, LineTable lines = {}, const GcConfig& gc = {}){
+    VM vm;
+    vm.heap.pauseTargetUs = gc.pauseTargetUs;
+    vm.heap.markThreads = gc.threads;
+    vm.heap.growthPercent = gc.growthPercent;
+    vm.heap.softLimit = gc.softLimit;
+    vm.heap.hardLimit = gc.hardLimit;
+    vm.heap.setNextFull();
+    installStackGuard(vm.opst);
+    vm.bc = bc;
+    vm.constants = constants;
+    vm.heap.makePermanent(constants, vm.constantObjects);
+    vm.lines = lines;
+    if (reg){
+        vm.enterFrame(-1, reg->registerCount);
+        runRegisters(vm, *reg, tracer);
+    }
+    else {
+        vm.enterFrame(-1, localCount);
+        run(vm, tracer);
+    }
+    if (gc.stats) {
+        vm.heap.stats.report(cerr);
+        vm.heap.reportSpaces(cerr);
+    }
+}
 
-                cout << "Got heap value at index " << n.data.intVal << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::SET_INDEX:{
-                Value value = vm.opst.back();
-                vm.opst.pop_back();
+// --bench: instruction counts and best-of-3 wall time for each tier, with program output suppressed.
+struct BenchTier {
+    const char* name;
+    CodeView bc;
+    const RegProgram* reg; // null for the stack interpreter
+};
 
-                Value index = vm.opst.back();
-                assert(index.tag == ValueType::INT);
-                vm.opst.pop_back();
+void benchmark(const vector<BenchTier>& tiers, int localCount, const vector<string>& constants, LineTable lines,
+               GcConfig gc){
+    gc.stats = false; // one report per run would bury the table
+    struct Row { const char* name; long long executed; size_t words; double ms; };
+    vector<Row> rows;
+    streambuf* saved = cout.rdbuf(nullptr);
+    for (auto& tier : tiers){
+        CountTrace counter;
+        execute(tier.bc, localCount, tier.reg, counter, constants, lines, gc);
+        double best = 1e18;
+        for (int i = 0; i < 3; i++){
+            NoTrace none;
+            auto start = chrono::steady_clock::now();
+            execute(tier.bc, localCount, tier.reg, none, constants, lines, gc);
+            best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        rows.push_back({tier.name, counter.executed, tier.reg ? tier.reg->code.size() : (size_t)tier.bc.size(), best});
+    }
+    cout.rdbuf(saved);
+    cout.clear();
+    cout << left << setw(13) << "tier" << setw(15) << "instructions" << setw(13) << "code words" << "time (ms)\n";
+    for (auto& row : rows){
+        cout << setw(13) << row.name << setw(15) << row.executed << setw(13) << row.words << fixed << setprecision(3) << row.ms << "\n";
+    }
+}
 
-                Value ref = vm.opst.back();
-                assert(ref.tag == ValueType::OBJECT);
-                assert(index.data.intVal < vm.heap[ref.data.objectHandle].arr.size() && index.data.intVal >= 0 
-                && vm.heap[ref.data.objectHandle].type == HeapType::ARRAY);
-                vm.opst.pop_back();
+// --lex-bench: lexer throughput over the program source, best of 5 passes.
+void lexBenchmark(string_view src){
+    size_t count = 0;
+    double best = 1e18;
+    for (int i = 0; i < 5; i++){
+        auto start = chrono::steady_clock::now();
+        Lexer lexer(src);
+        size_t n = 1;
+        while (lexer.next().type != TokenType::ENDOF) n++;
+        best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        count = n;
+    }
+#ifdef VM_SIMD_LEXER
+    const char* scanner = "sse2";
+#else
+    const char* scanner = "scalar";
+#endif
+    cout << "lexed " << src.size() << " bytes into " << count << " tokens in " << fixed << setprecision(3) << best
+         << " ms (" << scanner << "): " << setprecision(1) << src.size() / (best * 1e3) << " MB/s\n";
+}
 
-                vm.heap[ref.data.objectHandle].arr[index.data.intVal] = value;
+// Precompiled bytecode (.vmb), written by `vm compile` and executed from a read-only mapping. All fields are 32-bit
+// in native byte order and every section starts 4-byte aligned, so the code section is used in place as int words:
+//   header | code words | constant pool (per string: length, bytes, padding to 4) | function table | line table
+// The function table's first entry is the program's top level. Opcode numbers change between VM versions, so the
+// header records both the format version and the opcode count of the VM that wrote it.
+constexpr char VMB_MAGIC[4] = {'V', 'M', 'B', '\x1a'};
+constexpr uint32_t VMB_VERSION = 1;
 
-                cout << "Set heap value at index " << index.data.intVal << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::GRTRTHAN:{
-                Value right = vm.opst.back();
-                vm.opst.pop_back();
+struct VmbHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodeCount;
+    uint32_t codeOffset, codeWords;
+    uint32_t constOffset, constCount;
+    uint32_t funcOffset, funcCount;
+    uint32_t lineOffset, lineCount;
+};
+struct VmbFunction {
+    int32_t entry;     // code offset
+    int32_t slotCount; // locals in its frame
+};
 
-                Value left = vm.opst.back();
-                vm.opst.pop_back();
+bool writeVmb(const string& path, const vector<int>& code, const vector<string>& constants,
+              const vector<VmbFunction>& functions, const vector<LineEntry>& lines){
+    string pool;
+    for (auto& str : constants){
+        uint32_t n = str.size();
+        pool.append((const char*)&n, 4);
+        pool += str;
+        pool.append((4 - str.size() % 4) % 4, '\0');
+    }
+    VmbHeader h = {};
+    memcpy(h.magic, VMB_MAGIC, 4);
+    h.version = VMB_VERSION;
+    h.opcodeCount = OPCODE_COUNT;
+    h.codeOffset = sizeof(VmbHeader);
+    h.codeWords = code.size();
+    h.constOffset = h.codeOffset + code.size() * sizeof(int);
+    h.constCount = constants.size();
+    h.funcOffset = h.constOffset + pool.size();
+    h.funcCount = functions.size();
+    h.lineOffset = h.funcOffset + functions.size() * sizeof(VmbFunction);
+    h.lineCount = lines.size();
 
-                bool ret = left.data.intVal > right.data.intVal;
-                vm.opst.push_back(Value::Bool(ret));
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write((const char*)&h, sizeof(h));
+    out.write((const char*)code.data(), code.size() * sizeof(int));
+    out.write(pool.data(), pool.size());
+    out.write((const char*)functions.data(), functions.size() * sizeof(VmbFunction));
+    out.write((const char*)lines.data(), lines.size() * sizeof(LineEntry));
+    return (bool)out.flush();
+}
 
-                cout << "Compared > and pushed boolean " << ret << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::GRTREQUAL:{
-                Value right = vm.opst.back();
-                vm.opst.pop_back();
+bool isVmbFile(const string& path){ // only regular files: sniffing a pipe would eat the program's first bytes
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) return false;
+    char magic[4] = {};
+    ifstream in(path, ios::binary);
+    return in.read(magic, 4) && memcmp(magic, VMB_MAGIC, 4) == 0;
+}
 
-                Value left = vm.opst.back();
-                vm.opst.pop_back();
+struct VmbImage {
+    void* base = MAP_FAILED;
+    size_t size = 0;
+    CodeView code;
+    vector<string> constants;
+    const VmbFunction* functions = nullptr;
+    LineTable lines;
+    string error;
 
-                bool ret = left.data.intVal >= right.data.intVal;
-                vm.opst.push_back(Value::Bool(ret));
+    VmbImage() {}
+    VmbImage(const VmbImage&) = delete;
+    ~VmbImage(){ if (base != MAP_FAILED) munmap(base, size); }
 
-                cout << "compared >= and pushed boolean " << ret << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::EQUAL:{
-                assert(vm.opst.size() > 1);
-                Value right = vm.opst.back();
-                vm.opst.pop_back();
+    bool fail(const string& why){ error = why; return false; }
+    bool inFile(uint32_t offset, uint64_t bytes){ return offset % 4 == 0 && offset + bytes <= size; }
 
-                Value left = vm.opst.back();
-                vm.opst.pop_back();
+    bool load(const string& path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return fail(strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) < 0) { close(fd); return fail(strerror(errno)); }
+        size = st.st_size;
+        if (size < sizeof(VmbHeader)) { close(fd); return fail("truncated header"); }
+        base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping keeps the file alive
+        if (base == MAP_FAILED) return fail(strerror(errno));
 
-                bool ret = (left.data.intVal == right.data.intVal);
-                vm.opst.push_back(Value::Bool(ret));
+        const char* bytes = (const char*)base;
+        const VmbHeader& h = *(const VmbHeader*)bytes;
+        if (memcmp(h.magic, VMB_MAGIC, 4) != 0) return fail("not a .vmb file");
+        if (h.version != VMB_VERSION || h.opcodeCount != (uint32_t)OPCODE_COUNT)
+            return fail("compiled by an incompatible VM version, recompile it");
+        if (!inFile(h.codeOffset, (uint64_t)h.codeWords * sizeof(int)) || !inFile(h.constOffset, 0)
+            || !inFile(h.funcOffset, (uint64_t)h.funcCount * sizeof(VmbFunction))
+            || !inFile(h.lineOffset, (uint64_t)h.lineCount * sizeof(LineEntry)) || h.funcCount == 0)
+            return fail("corrupt section table");
 
-                cout << "Compared == and pushed boolean " << ret << endl;
-                vm.ip++;
-                continue;
+        code = CodeView((const int*)(bytes + h.codeOffset), h.codeWords);
+        vector<char> starts(code.size() + 1); // instruction boundaries; jumping to the very end halts
+        for (int i = 0; i < code.size(); i += 1 + operandCount((Opcode) code[i])){
+            if (code[i] < 0 || code[i] >= OPCODE_COUNT || i + operandCount((Opcode) code[i]) >= code.size())
+                return fail("corrupt code at offset " + to_string(i));
+            starts[i] = true;
+        }
+        starts[code.size()] = true;
+        for (int i = 0; i < code.size(); i += 1 + operandCount((Opcode) code[i])){
+            int k = jumpOperand((Opcode) code[i]);
+            if (k >= 0 && (code[i + 1 + k] < 0 || code[i + 1 + k] > code.size() || !starts[code[i + 1 + k]]))
+                return fail("jump out of range at offset " + to_string(i));
+        }
+        uint32_t at = h.constOffset;
+        for (uint32_t i = 0; i < h.constCount; i++){
+            if (!inFile(at, 4)) return fail("corrupt constant pool");
+            uint32_t n = *(const uint32_t*)(bytes + at);
+            if (!inFile(at, 4 + (uint64_t)n)) return fail("corrupt constant pool");
+            constants.push_back(string(bytes + at + 4, n));
+            at += 4 + n + (4 - n % 4) % 4;
+        }
+        functions = (const VmbFunction*)(bytes + h.funcOffset);
+        for (uint32_t i = 0; i < h.funcCount; i++){
+            if (functions[i].entry < 0 || functions[i].entry >= code.size() || functions[i].slotCount < 0)
+                return fail("corrupt function table");
+        }
+        int bad = badOperand(functions[0].entry, functions[0].slotCount, h.constCount);
+        if (bad >= 0) return fail("corrupt code at offset " + to_string(bad));
+        lines = LineTable((const LineEntry*)(bytes + h.lineOffset), h.lineCount);
+        return true;
+    }
+
+    // Offset of the first instruction that would index past its frame's slots or the constant pool, or -1. A frame
+    // is the code reachable from its entry up to RET or HALT; each CALL starts one of its own, sized by the CALL's
+    // slot count, and is checked once per (entry, slot count).
+    int badOperand(int entry, int slotCount, uint32_t constCount){
+        vector<pair<int, int>> frames = {{entry, slotCount}};
+        unordered_set<int64_t> checked;
+        vector<char> visited(code.size());
+        while (!frames.empty()){
+            auto [start, slots] = frames.back();
+            frames.pop_back();
+            if (!checked.insert((int64_t)start << 32 | (uint32_t)slots).second) continue;
+            fill(visited.begin(), visited.end(), false);
+            vector<int> work = {start};
+            while (!work.empty()){
+                int i = work.back();
+                work.pop_back();
+                if (i == code.size() || visited[i]) continue;
+                visited[i] = true;
+                Opcode op = (Opcode) code[i];
+                auto slot = [&](int k){ return code[i + 1 + k] >= 0 && code[i + 1 + k] < slots; };
+                switch (op){
+                    case Opcode::GET_LOCAL: case Opcode::SET_LOCAL: case Opcode::SET_LOCAL_POP: case Opcode::FOR_RANGE:
+                        if (!slot(0)) return i;
+                        break;
+                    case Opcode::ADD_LL: case Opcode::FOR_RANGE_L:
+                        if (!slot(0) || !slot(1)) return i;
+                        break;
+                    case Opcode::ALLOC_STRING:
+                        if (code[i + 1] < 0 || (uint32_t)code[i + 1] >= constCount) return i;
+                        break;
+                    case Opcode::CALL:
+                        if (code[i + 2] < 0) return i;
+                        frames.push_back({code[i + 1], code[i + 2]});
+                        break;
+                    case Opcode::RET: case Opcode::HALT: continue;
+                    default: break;
+                }
+                int k = jumpOperand(op);
+                if (k >= 0 && op != Opcode::CALL) work.push_back(code[i + 1 + k]);
+                if (op != Opcode::JUMP) work.push_back(i + 1 + operandCount(op));
             }
-            case Opcode::LESSTHAN:{
-                Value right = vm.opst.back();
-                vm.opst.pop_back();
+        }
+        return -1;
+    }
+};
 
-                Value left = vm.opst.back();
-                vm.opst.pop_back();
+// Content-addressed cache of compiled programs (VM_CACHE_DIR or --cache-dir). An entry is a .vmb named after a hash
+// of the source text, the compiler and format versions and the optimization level, so editing a script or upgrading
+// the VM simply misses. Writers finish a private temp file and rename() it into place, so concurrent runs never see
+// a partial entry. Hits refresh the entry's mtime and eviction removes the least recently used entries once the
+// directory grows past maxBytes. Hit/miss counters live in a small binary file updated under flock().
+constexpr const char* COMPILER_VERSION = "16"; // bump whenever the same source may compile differently
 
-                bool ret = left.data.intVal < right.data.intVal;
-                vm.opst.push_back(Value::Bool(ret));
+struct BytecodeCache {
+    string dir;
+    uint64_t maxBytes = 64ull << 20;
 
-                cout << "Compared < and pushed boolean " << ret << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::LESSEQUAL:{
-                Value right = vm.opst.back();
-                vm.opst.pop_back();
+    struct Counters { uint64_t hits = 0, misses = 0; };
 
-                Value left = vm.opst.back();
-                vm.opst.pop_back();
+    static uint64_t hash(string_view data, uint64_t h){ // FNV-1a
+        for (unsigned char ch : data) { h ^= ch; h *= 0x100000001b3ull; }
+        return h;
+    }
+    string keyFor(SourceFile& src, int optLevel){
+        string salt = string(COMPILER_VERSION) + "/" + to_string(VMB_VERSION) + "/" + to_string(OPCODE_COUNT)
+                    + "/O" + to_string(optLevel) + "\n";
+        // two independent 64-bit hashes: a collision would silently run the wrong program
+        uint64_t a = hash(salt, 0xcbf29ce484222325ull);
+        uint64_t b = hash(salt, 0x84222325cbf29ce4ull) ^ src.size;
+        for (size_t at = 0; at < src.size; at += SourceFile::RELEASE_CHUNK){ // giving pages back as they are hashed
+            string_view chunk = src.view().substr(at, SourceFile::RELEASE_CHUNK);
+            a = hash(chunk, a);
+            b = hash(chunk, b);
+            src.release(at + chunk.size());
+        }
+        src.rewind();
+        char key[33];
+        snprintf(key, sizeof(key), "%016llx%016llx", (unsigned long long)a, (unsigned long long)b);
+        return key;
+    }
+    string pathFor(const string& key){ return dir + "/" + key + ".vmb"; }
 
-                bool ret = left.data.intVal <= right.data.intVal;
-                vm.opst.push_back(Value::Bool(ret));
+    bool prepare(){
+        return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+    }
+    void touch(const string& path){
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    }
+    bool store(const string& key, const vector<int>& code, const vector<string>& constants,
+               const vector<VmbFunction>& functions, const vector<LineEntry>& lines){
+        string tmp = dir + "/." + key + ".tmp." + to_string(getpid());
+        if (!writeVmb(tmp, code, constants, functions, lines) || rename(tmp.c_str(), pathFor(key).c_str()) < 0){
+            unlink(tmp.c_str());
+            return false;
+        }
+        evict();
+        return true;
+    }
+    void evict(){ // least recently used first, until the entries fit in maxBytes
+        DIR* d = opendir(dir.c_str());
+        if (!d) return;
+        vector<pair<timespec, pair<string, uint64_t>>> entries;
+        uint64_t total = 0;
+        while (dirent* e = readdir(d)){
+            string name = e->d_name;
+            if (name.size() < 4 || name.compare(name.size() - 4, 4, ".vmb") != 0) continue;
+            struct stat st;
+            if (stat((dir + "/" + name).c_str(), &st) < 0) continue;
+            entries.push_back({st.st_mtim, {name, (uint64_t)st.st_size}});
+            total += st.st_size;
+        }
+        closedir(d);
+        if (total <= maxBytes) return;
+        sort(entries.begin(), entries.end(), [](const auto& x, const auto& y){
+            return x.first.tv_sec != y.first.tv_sec ? x.first.tv_sec < y.first.tv_sec : x.first.tv_nsec < y.first.tv_nsec;
+        });
+        for (auto& e : entries){
+            if (total <= maxBytes) break;
+            if (unlink((dir + "/" + e.second.first).c_str()) == 0) total -= e.second.second;
+        }
+    }
+    Counters count(bool hit, bool update = true){
+        Counters c;
+        int fd = open((dir + "/stats").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return c;
+        flock(fd, LOCK_EX);
+        if (pread(fd, &c, sizeof(c), 0) != sizeof(c)) c = Counters();
+        if (update){
+            (hit ? c.hits : c.misses)++;
+            if (pwrite(fd, &c, sizeof(c), 0) != sizeof(c)) {}
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+        return c;
+    }
+};
 
-                cout << "Compared <= and pushed boolean " << ret << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::NOTEQUAL:{
-                Value right = vm.opst.back();
-                vm.opst.pop_back();
+// --pair-stats: dynamic opcode-pair histogram, the raw material for picking new superinstructions.
+struct PairProfile {
+    static constexpr bool enabled = true;
+    vector<long long> counts = vector<long long>(OPCODE_COUNT * OPCODE_COUNT, 0);
+    int prev = -1;
+    void record(const VM &vm){
+        int op = vm.bc[vm.ip];
+        if (prev >= 0 && op >= 0 && op < OPCODE_COUNT) counts[prev * OPCODE_COUNT + op]++;
+        prev = op;
+    }
+    void recordRegister(const VM&, int, int){}
+    void report(ostream& out, int top){
+        vector<pair<long long, int>> sorted;
+        for (int i = 0; i < (int)counts.size(); i++) if (counts[i]) sorted.push_back({counts[i], i});
+        sort(sorted.rbegin(), sorted.rend());
+        for (int i = 0; i < (int)sorted.size() && i < top; i++){
+            out << setw(12) << sorted[i].first << "  " << opcodeName((Opcode)(sorted[i].second / OPCODE_COUNT))
+                << " -> " << opcodeName((Opcode)(sorted[i].second % OPCODE_COUNT)) << "\n";
+        }
+    }
+};
 
-                Value left = vm.opst.back();
-                vm.opst.pop_back();
+// Front end and optimizer: source text to the code both tiers run.
+struct CompiledProgram {
+    vector<int> plain;       // optimized stack code, input of the register translator; empty if it equals `fused`
+    vector<int> fused;       // the same with superinstructions (-O2), what the stack tier runs
+    vector<LineEntry> lines; // for `fused`
+    vector<string> constants;
+    int localCount = 0;
+    OptStats stats;
+};
 
-                bool ret = left.data.intVal != right.data.intVal;
-                vm.opst.push_back(Value::Bool(ret));
+// The front end streams: each top-level statement is parsed, folded and compiled as soon as its last token is
+// read, then its tree and the source behind it are dropped, so only the bytecode grows with the program.
+CompiledProgram compileSource(SourceFile& source, int optLevel){
+    Lexer lexer(source.view());
+    TokenStream tokens(lexer);
+    Ast ast;
+    Parser parser(tokens, ast);
+    Folder folder(ast);
+    Compiler c(ast);
+    while (!parser.atEnd()){
+        NodeId stmt = parser.parseStatement();
+        if (optLevel >= 1) stmt = folder.stmt(stmt);
+        c.compileStmt(stmt);
+        ast.clear();
+        const Token& next = parser.peek();
+        source.release(next.type == TokenType::ENDOF ? source.size : next.lexeme.data() - source.data);
+    }
+    c.emit(Opcode::HALT);
 
-                cout << "Compared != and pushed boolean " <<  ret << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::GET_LOCAL: {
-                int n = vm.bc[++vm.ip];
-                vm.opst.push_back(vm.callst.back().locals[n]);
+    CompiledProgram out;
+    out.constants = move(ast.strings);
+    out.localCount = c.nextLocalSlot;
+    if (optLevel == 0){ // nothing to rewrite, skip the instruction list
+        for (size_t i = 0; i < c.bytecode.size(); i += 1 + operandCount((Opcode)c.bytecode[i])) out.stats.before++;
+        out.stats.after = out.stats.before;
+        out.fused = move(c.bytecode);
+        out.lines = move(c.lines);
+        return out;
+    }
+    vector<Instr> instrs = decode(c.bytecode, c.lines);
+    vector<int>().swap(c.bytecode);
+    out.stats = optimize(instrs, optLevel);
+    out.stats.folded = folder.folded;
+    if (optLevel >= 2){
+        out.plain = encode(instrs);
+        out.stats.fused = fuseSuperinstructions(instrs);
+    }
+    out.stats.after = instrs.size();
+    out.fused = encode(instrs, &out.lines);
+    return out;
+}
 
-                cout << "Pushed local @ " << n << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::SET_LOCAL:{
-                int n = vm.bc[++vm.ip];
-                Value val = vm.opst.back();
-                //vm.opst.pop_back(); this line is incorrect and was a pretty frustrating bug; we already emit POP after SET_LOCAL, so the VM ends up popping twice-stack underflow
-                callFrame &frame = vm.callst.back();
-                
-                if (n >= frame.locals.size()) frame.locals.resize(n + 1);
-                vm.callst.back().locals[n] = val;
+// Bytecode listings (.bc): stack bytecode written out by hand, one instruction per line, for the tests and for
+// opcodes the language has no syntax for yet. An operand is an integer, a label (`name:` at the start of a line
+// marks the instruction after it), an opcode name (ARRAY_MAP's operation), a packed array kind (INT32_ARRAY,
+// INT64_ARRAY, BOOL_ARRAY) or a string in double quotes, which gets a constant pool entry of its own. `#` starts a
+// comment. The top-level frame gets every slot a local-slot operand names.
+bool isListing(const string& path){
+    return path.size() > 3 && path.compare(path.size() - 3, 3, ".bc") == 0;
+}
 
-                cout << "Set local" << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::NEG:{
-                assert(vm.opst.back().tag == ValueType::INT);
-                int v = vm.opst.back().data.intVal;
-                vm.opst.pop_back();
-                vm.opst.push_back(Value::Int(-v));
+// splits a listing line into words; a quoted string is one word, quotes included
+vector<string_view> listingWords(string_view line){
+    vector<string_view> words;
+    size_t i = 0;
+    while (true){
+        while (i < line.size() && isspace((unsigned char)line[i])) i++;
+        if (i == line.size() || line[i] == '#') return words;
+        size_t end = line[i] == '"' ? line.find('"', i + 1) : i;
+        if (end == string_view::npos) end = line.size() - 1; // unterminated, reported as a bad operand
+        while (end < line.size() && !isspace((unsigned char)line[end]) && line[end] != '#') end++;
+        words.push_back(line.substr(i, end - i));
+        i = end;
+    }
+}
 
-                cout << "Negated and pushed integer" << -v << endl;
-                vm.ip++;
-                continue;
-            }
-            case Opcode::NOT:{
-                assert(vm.opst.back().tag == ValueType::BOOL);
-                bool v = vm.opst.back().data.boolVal;
-                vm.opst.pop_back();
-                vm.opst.push_back(Value::Bool(!v));
+bool assemble(string_view text, CompiledProgram& out, string& error){
+    unordered_map<string, int> names;
+    for (int op = 0; op < OPCODE_COUNT; op++) names[opcodeName((Opcode)op)] = op;
+    const unordered_map<string, int> kinds = {
+        {"INT32_ARRAY", (int)HeapType::INT32_ARRAY}, {"INT64_ARRAY", (int)HeapType::INT64_ARRAY}, {"BOOL_ARRAY", (int)HeapType::BOOL_ARRAY}};
+    unordered_map<string, int> labels;
+    struct Fixup { size_t at; string label; int line; };
+    vector<Fixup> fixups;
+    vector<int>& code = out.fused;
+    int line = 0;
+    auto fail = [&](const string& why){ error = "line " + to_string(line) + ": " + why; return false; };
 
-                cout << "Boolean negated and pushed boolean " << !v << endl;
-                vm.ip++;
-                continue;
+    for (size_t start = 0; start < text.size(); ){
+        size_t end = min(text.find('\n', start), text.size());
+        vector<string_view> words = listingWords(text.substr(start, end - start));
+        start = end + 1;
+        line++;
+        if (!words.empty() && words[0].size() > 1 && words[0].back() == ':'){
+            string label(words[0].substr(0, words[0].size() - 1));
+            if (!labels.emplace(label, code.size()).second) return fail("label '" + label + "' defined twice");
+            words.erase(words.begin());
+        }
+        if (words.empty()) continue;
+        auto op = names.find(string(words[0]));
+        if (op == names.end()) return fail("unknown instruction '" + string(words[0]) + "'");
+        if ((int)words.size() - 1 != operandCount((Opcode)op->second))
+        {
+            int n = operandCount((Opcode)op->second);
+            return fail(string(words[0]) + " takes " + to_string(n) + (n == 1 ? " operand" : " operands"));
+        }
+        if (out.lines.empty() || out.lines.back().line != line) out.lines.push_back({(int)code.size(), line});
+        code.push_back(op->second);
+        for (size_t k = 1; k < words.size(); k++){
+            string_view w = words[k];
+            int value = 0;
+            if (from_chars(w.data(), w.data() + w.size(), value).ptr == w.data() + w.size()) code.push_back(value);
+            else if (w.size() >= 2 && w.front() == '"' && w.back() == '"'){
+                code.push_back(out.constants.size());
+                out.constants.push_back(string(w.substr(1, w.size() - 2)));
             }
-            case Opcode::RET:{
-                assert(!vm.callst.empty());
-                callFrame temp = vm.callst.back();
-                int base = temp.frameBase;
-                int retIP = temp.returnIP;
-                
-                bool hasReturn = vm.opst.size() > base;
-                if (hasReturn) {
-                    Value returnValue = vm.opst.back(); // only initialise a value if it will correspond to a real runtime value.
-                    vm.opst.resize(base);
-                    vm.opst.push_back(returnValue);
-                } else {
-                    vm.opst.resize(base);
-                }
+            else if (names.count(string(w))) code.push_back(names[string(w)]);
+            else if (kinds.count(string(w))) code.push_back(kinds.at(string(w)));
+            else if (isalpha((unsigned char)w[0]) || w[0] == '_'){
+                fixups.push_back({code.size(), string(w), line});
+                code.push_back(0);
+            }
+            else return fail("bad operand '" + string(w) + "'");
+        }
+        Opcode o = (Opcode)op->second;
+        int at = code.size() - operandCount(o);
+        if (o == Opcode::GET_LOCAL || o == Opcode::SET_LOCAL || o == Opcode::SET_LOCAL_POP || o == Opcode::FOR_RANGE)
+            out.localCount = max(out.localCount, code[at] + 1);
+        else if (o == Opcode::ADD_LL || o == Opcode::FOR_RANGE_L)
+            out.localCount = max({out.localCount, code[at] + 1, code[at + 1] + 1});
+    }
+    for (const Fixup& f : fixups){
+        auto it = labels.find(f.label);
+        line = f.line;
+        if (it == labels.end()) return fail("undefined label '" + f.label + "'");
+        code[f.at] = it->second;
+    }
+    code.push_back((int)Opcode::HALT); // so a listing may simply stop, like a program does after its last statement
+    return true;
+}
 
-                vm.callst.pop_back(); // call stack cleanup
-                vm.ip = retIP;
+int main (int argc, char** argv){
+    string path = "program.vm";
+    string tracePath, outPath;
+    bool registerTier = false, bench = false, lexBench = false, pairStats = false, optReport = false, compileOnly = false, cacheStats = false;
+    int optLevel = 2;
+    GcConfig gc;
+    BytecodeCache cache;
+    if (const char* dir = getenv("VM_CACHE_DIR")) cache.dir = dir;
+    if (const char* mb = getenv("VM_CACHE_MAX_MB")) cache.maxBytes = strtoull(mb, nullptr, 10) << 20;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "compile") compileOnly = true;
+        else if (arg == "--cache-dir" && i + 1 < argc) cache.dir = argv[++i];
+        else if (arg == "--no-cache") cache.dir.clear();
+        else if (arg == "--cache-stats") cacheStats = true;
+        else if (arg == "-o" && i + 1 < argc) outPath = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc) tracePath = argv[++i];
+        else if (arg == "--tier=stack") registerTier = false;
+        else if (arg == "--tier=reg") registerTier = true;
+        else if (arg == "--bench") bench = true;
+        else if (arg == "--lex-bench") lexBench = true;
+        else if (arg == "--pair-stats") pairStats = true;
+        else if (arg == "--gc-stats") gc.stats = true;
+        else if (arg.rfind("--gc-pause=", 0) == 0) gc.pauseTargetUs = atof(arg.c_str() + 11);
+        else if (arg.rfind("--gc-threads=", 0) == 0) gc.threads = max(1, atoi(arg.c_str() + 13));
+        else if (arg == "--gc-growth=off") gc.growthPercent = -1;
+        else if (arg.rfind("--gc-growth=", 0) == 0) gc.growthPercent = max(0, atoi(arg.c_str() + 12));
+        else if (arg.rfind("--gc-soft-limit=", 0) == 0) gc.softLimit = strtoull(arg.c_str() + 16, nullptr, 10) << 20;
+        else if (arg.rfind("--gc-hard-limit=", 0) == 0) gc.hardLimit = strtoull(arg.c_str() + 16, nullptr, 10) << 20;
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2") optLevel = arg[2] - '0';
+        else if (arg == "--opt-report") optReport = true;
+        else if (arg.size() > 1 && arg[0] == '-'){
+            cerr << "usage: " << argv[0] << " [-O0|-O1|-O2] [--opt-report] [--trace <file>] [--tier=stack|reg] [--bench] [--lex-bench] [--pair-stats]\n"
+                 << "       " << string(strlen(argv[0]), ' ') << " [--gc-stats] [--gc-pause=<us>] [--gc-threads=<n>] [--gc-growth=<percent>|off]\n"
+                 << "       " << string(strlen(argv[0]), ' ') << " [--gc-soft-limit=<MB>] [--gc-hard-limit=<MB>] [--cache-dir <dir>] [--no-cache] [--cache-stats] [program]\n"
+                 << "       " << argv[0] << " compile [-O0|-O1|-O2] [--opt-report] [-o <file.vmb>] [program]\n";
+            return 1;
+        }
+        else path = arg;
+    }
 
-                cout << "Returned to: " << retIP << endl;
-                continue;
-            }
-            case Opcode::PRINT: {
-                Value v = vm.opst.back();
-                vm.opst.pop_back();
+    // what the tiers run: `code` on the stack interpreter, `plain` (no superinstructions) through the register translator
+    CodeView code, plain;
+    int localCount = 0;
+    bool fused = false;
+    vector<string> constants;
+    LineTable lines;
 
-                switch (v.tag) {
-                    case ValueType::INT:
-                        cout << v.data.intVal << "\n";
-                        break;
-                    case ValueType::BOOL:
-                        cout << (v.data.boolVal ? "true" : "false") << "\n";
-                        break;
-                    case ValueType::NIL:
-                        cout << "nil\n";
-                        break;
-                    default:
-                        cout << "<object>\n";
-                }
+    if (cacheStats){
+        if (cache.dir.empty()) { cerr << "no cache directory, set VM_CACHE_DIR or pass --cache-dir\n"; return 1; }
+        BytecodeCache::Counters counters = cache.count(false, false);
+        cout << "cache " << cache.dir << ": " << counters.hits << " hits, " << counters.misses << " misses\n";
+        return 0;
+    }
 
-                vm.ip++;
-                continue;
-            }
-            case Opcode::JUMP_IF_FALSE: {
-                assert(vm.opst.size() > 0);
-                Value val = vm.opst.back();
-                vm.opst.pop_back();
-                assert(val.tag == ValueType::BOOL);
+    VmbImage image;
+    CompiledProgram prog;
+    bool loaded = false; // running from a mapped .vmb, either given directly or found in the cache
+    if (!compileOnly && isVmbFile(path)){
+        if (!image.load(path)) { cerr << path << ": " << image.error << "\n"; return 1; }
+        loaded = true;
+    }
+    else {
+        SourceFile src;
+        if (!src.load(path)) { perror(path.c_str()); return 1; }
+        if (lexBench) { lexBenchmark(src.view()); return 0; }
 
-                int n = vm.bc[++vm.ip];
-                if (!val.data.boolVal) vm.ip = n;
-                else vm.ip++;
-                continue;
-            }
-            case Opcode::JUMP: {
-                int n = vm.bc[++vm.ip];
-                vm.ip = n;
-                continue;
+        // the cache holds what a plain run executes; runs that need the front end's other outputs bypass it
+        bool listing = isListing(path);
+        bool useCache = !listing && !cache.dir.empty() && !compileOnly && !registerTier && !bench && !optReport && cache.prepare();
+        string cacheKey;
+        if (useCache){
+            cacheKey = cache.keyFor(src, optLevel);
+            loaded = image.load(cache.pathFor(cacheKey));
+            cache.count(loaded);
+            if (loaded) cache.touch(cache.pathFor(cacheKey));
+        }
+        if (!loaded){
+            string error;
+            if (!listing) prog = compileSource(src, optLevel);
+            else if (!assemble(src.view(), prog, error)) { cerr << path << ": " << error << "\n"; return 1; }
+            OptStats& stats = prog.stats;
+            if (optReport && !listing){
+                cerr << "-O" << optLevel << ": " << stats.before << " -> " << stats.after << " instructions, removed "
+                     << stats.before - stats.after << " (peephole " << stats.peephole << ", dead code " << stats.deadCode
+                     << ", dead stores " << stats.deadStores << ", superinstructions " << stats.fused << "), "
+                     << stats.threaded << " jumps threaded, " << stats.folded << " expressions folded\n";
             }
-            default:{
-                perror("Wrong opcode");
-                running = false;
-                break;
+            vector<VmbFunction> functions = {{0, prog.localCount}};
+            if (compileOnly){
+                if (outPath.empty()) outPath = path.substr(0, path.rfind('.') == string::npos ? path.size() : path.rfind('.')) + ".vmb";
+                if (!writeVmb(outPath, prog.fused, prog.constants, functions, prog.lines)) { perror(outPath.c_str()); return 1; }
+                return 0;
             }
+            if (useCache) cache.store(cacheKey, prog.fused, prog.constants, functions, prog.lines);
+        }
+    }
+    if (loaded){
+        code = plain = image.code;
+        localCount = image.functions[0].slotCount;
+        constants = image.constants;
+        lines = image.lines;
+    }
+    else {
+        code = prog.fused;
+        plain = prog.plain.empty() ? prog.fused : prog.plain;
+        fused = !prog.plain.empty();
+        localCount = prog.localCount;
+        constants = prog.constants;
+        lines = prog.lines;
+    }
+
+    RegProgram regProg;
+    RegisterTranslator translator(plain, regProg);
+    bool translated = (registerTier || bench) && translator.translate(localCount);
+    if (registerTier && !translated) cerr << "register tier: " << translator.error << ", using the stack interpreter\n";
+    const RegProgram* reg = translated ? &regProg : nullptr;
+
+    if (bench){
+        vector<BenchTier> tiers = {{"stack", plain, nullptr}};
+        if (fused) tiers.push_back({"stack+fused", code, nullptr});
+        if (reg) tiers.push_back({"reg", plain, reg});
+        benchmark(tiers, localCount, constants, lines, gc);
+        if (!reg) cout << "reg          (not translatable: " << translator.error << ")\n";
+        return 0;
+    }
+    if (pairStats){
+        PairProfile profile;
+        streambuf* saved = cout.rdbuf(nullptr);
+        execute(code, localCount, nullptr, profile, constants, lines);
+        cout.rdbuf(saved);
+        cout.clear();
+        profile.report(cout, 20);
+        return 0;
+    }
+    if (!tracePath.empty()){
+        FileTrace tracer(tracePath);
+        if (!tracer.out) { perror(tracePath.c_str()); return 1; }
+        tracer.out << "bytecode:";
+        for (int i = 0; i < code.size(); i++) tracer.out << " " << code[i];
+        tracer.out << "\n";
+        if (registerTier && reg){
+            tracer.out << "register code:";
+            for (auto x : reg->code) tracer.out << " " << x;
+            tracer.out << "\n";
         }
+        execute(code, localCount, registerTier ? reg : nullptr, tracer, constants, lines, gc);
+    }
+    else {
+        NoTrace tracer;
+        execute(code, localCount, registerTier ? reg : nullptr, tracer, constants, lines, gc);
     }
 }